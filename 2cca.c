@@ -6,17 +6,43 @@
  * (c) nicolas314 -- MIT license
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE     /* syncfs */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <strings.h>
 
 #include <openssl/asn1.h>
 #include <openssl/bn.h>
+#include <openssl/crypto.h>
 #include <openssl/ec.h>
+#ifndef OPENSSL_NO_ENGINE
+#include <openssl/engine.h>
+#endif
+#include <openssl/err.h>
+#include <openssl/ocsp.h>
 #include <openssl/pem.h>
 #include <openssl/pkcs12.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 
@@ -27,19 +53,28 @@
 #define MAX_SAN     8
 #define BIG_FIELD   (MAX_SAN*(FIELD_SZ+1))
 
+#define BATCH_LINE  4096    /* longest request line */
+#define BATCH_WORDS 64      /* max key=val fields per request */
+
 /* Use to shuffle key+cert around */
 typedef struct _identity_ {
     EVP_PKEY * key ;
     X509    * cert ;
+    int       key_uri ;     /* key is kept in a token */
 } identity ;
 
-/* Config variables */
+/*
+ * One identity request. certinfo is the one given on the command line
+ * and is only read once a command runs: batch lines, daemon requests,
+ * signed CSRs and renewals each fill their own copy.
+ */
 struct _certinfo_ {
     char o [FIELD_SZ+1];
     char ou[FIELD_SZ+1];
     char cn[FIELD_SZ+1];
     char c [FIELD_SZ+1];
     int  days ;
+    int  days_given ;   /* renewals keep the original validity otherwise */
     char l [FIELD_SZ+1];
     char st[FIELD_SZ+1];
     char san[FIELD_SZ+1] ;
@@ -51,12 +86,63 @@ struct _certinfo_ {
         PROFILE_SERVER,
         PROFILE_CLIENT,
         PROFILE_WWW,
+        PROFILE_CUSTOM,     /* defined in a profiles file */
     } profile ;
+    int custom ;    /* index in profiles[] */
     char signing_ca[FIELD_SZ+1];
     int rsa_keysz ;
     char ec_name[FIELD_SZ+1] ;
+    int reason ;    /* CRL reason code for revocations */
+    int replace ;   /* renewal: files of the previous certificate are overwritten */
 } certinfo ;
 
+/* Number of key generation threads, set with jobs=N */
+static int n_jobs = 1 ;
+/* Number of items for commands that produce many, set with count=N */
+static int n_count = 0 ;
+/* Directory holding pre-generated keys, set with pool=DIR */
+static char keypool_dir[FIELD_SZ+1] = "keypool" ;
+/* Unix socket for serve mode, set with socket=PATH */
+static char serve_path[FIELD_SZ+1] = "" ;
+/* TCP port for the OCSP responder, set with port=N */
+static int ocsp_port = 0 ;
+/* Serial number to look for, set with serial=HEX */
+static char find_serial[FIELD_SZ+1] = "" ;
+/* DH parameter size, set with bits=N */
+static int dh_bits = 2048 ;
+/* Root of the sharded store, set with store=DIR. Empty for a flat layout */
+static char store_dir[FIELD_SZ+1] = "" ;
+/* Output format for crl, set with format=json|csv|bin. Empty for text */
+static char out_format[FIELD_SZ+1] = "" ;
+/*
+ * PKCS#12 key derivation and MAC iterations for client bundles, set
+ * with p12=fast|strong|no. The bundles have no password, so fast only
+ * gives up a cost nobody benefits from. 0 skips the bundle.
+ */
+#define P12_FAST_ITER   1
+static int p12_iter = PKCS12_DEFAULT_ITER ;
+/* Requests to sign, set with csr=FILE (- for stdin) or dir=DIR */
+static char csr_path[FIELD_SZ+1] = "" ;
+static char csr_dir[FIELD_SZ+1] = "" ;
+/* Profile applied to signed requests, set with profile=xx */
+static char sign_profile[FIELD_SZ+1] = "client" ;
+/* Engine for CA keys kept in a token, set with engine=ID */
+static char engine_id[FIELD_SZ+1] = "pkcs11" ;
+/* Renewal window in seconds, set with within=N[d|h|w] */
+static long renew_within = 30*24*60*60 ;
+/* Revoke renewed certificates as superseded, set with revoke=yes */
+static int renew_revoke = 0 ;
+/* Revocations go to the CA journal and are merged unless the CRL is busy, queue=yes */
+static int revoke_queue = 0 ;
+
+/* CRL reason codes (RFC 5280), 7 is not used */
+static const char * crl_reasons[] = {
+    "unspecified", "keyCompromise", "cACompromise", "affiliationChanged",
+    "superseded", "cessationOfOperation", "certificateHold", NULL,
+    "removeFromCRL", "privilegeWithdrawn", "aACompromise"
+} ;
+#define N_REASONS   (int)(sizeof(crl_reasons)/sizeof(crl_reasons[0]))
+
 /*
  * Set one extension in a given certificate
  */
@@ -75,22 +161,63 @@ static int set_extension(X509 * issuer, X509 * cert, int nid, char * value)
     return 0 ;
 }
 
+/*
+ * Random serials are drawn from the libcrypto DRBG, seeded once per
+ * process, a block at a time: serial_reserve(n) makes sure the next n
+ * serials are available without calling into the RNG again.
+ */
+#define SERIAL_BLOCK    64
+
+static unsigned char * serial_pool = NULL ;
+static int serial_pool_sz = 0 ;
+static int serial_avail   = 0 ;
+
+static int serial_reserve(int n)
+{
+    unsigned char * pool ;
+
+    if (n<=serial_avail)
+        return 0 ;
+    if (n>serial_pool_sz) {
+        if ((pool=realloc(serial_pool, n * SERIAL_SZ))==NULL)
+            return -1 ;
+        serial_pool = pool ;
+        serial_pool_sz = n ;
+    }
+    /* Keep what is left, at the front of the pool */
+    if (RAND_bytes(serial_pool + serial_avail*SERIAL_SZ, (n-serial_avail)*SERIAL_SZ)!=1) {
+        fprintf(stderr, "Cannot get random bytes for serial numbers\n");
+        return -1 ;
+    }
+    serial_avail = n ;
+    return 0 ;
+}
+
+/*
+ * Next 128-bit serial, always starting with 0x2cca
+ */
+static int serial_next(unsigned char * c_serial)
+{
+    if (serial_avail==0 && serial_reserve(SERIAL_BLOCK)!=0)
+        return -1 ;
+    serial_avail-- ;
+    memcpy(c_serial, serial_pool + serial_avail*SERIAL_SZ, SERIAL_SZ);
+    OPENSSL_cleanse(serial_pool + serial_avail*SERIAL_SZ, SERIAL_SZ);
+    c_serial[0]=0x2c ;
+    c_serial[1]=0xca ;
+    return 0 ;
+}
+
 /*
  * Set serial to a random 128-bit number
  */
 static int set_serial128(X509 * cert)
 {
-    FILE * urandom;
     BIGNUM *        b_serial ;
     unsigned char   c_serial[SERIAL_SZ] ;
 
-    /* Read random bits from /dev/urandom */
-    urandom = fopen("/dev/urandom", "rb");
-    fread(c_serial, SERIAL_SZ, 1, urandom);
-    fclose(urandom);
-
-    c_serial[0]=0x2c ;
-    c_serial[1]=0xca ;
+    if (serial_next(c_serial)!=0)
+        return -1 ;
 
     b_serial = BN_bin2bn(c_serial, SERIAL_SZ, NULL);
     BN_to_ASN1_INTEGER(b_serial, X509_get_serialNumber(cert));
@@ -114,570 +241,6944 @@ static void progress(int p, int n, void *arg)
 }
 
 /*
- * Load CA certificate and private key from current dir
+ * Microseconds from an arbitrary starting point
  */
-static int load_ca(char * ca_name, identity * ca)
+static double now_usec(void)
 {
-    FILE * f ;
-    RSA  * rsa ;
-    char filename[FIELD_SZ+1] ;
+    struct timespec ts ;
 
-    sprintf(filename, "%s.crt", ca_name);
-    if ((f=fopen(filename, "r"))==NULL) {
-        fprintf(stderr, "Cannot find: %s\n", filename);
-        return -1 ; 
-    }
-    ca->cert = PEM_read_X509(f, NULL, NULL, NULL);
-    fclose(f);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e6 + ts.tv_nsec/1e3 ;
+}
 
-    sprintf(filename, "%s.key", ca_name);
-    if ((f=fopen(filename, "r"))==NULL) {
-        return -1 ; 
-    }
-    rsa = PEM_read_RSAPrivateKey(f, NULL, NULL, NULL);
-    fclose(f);
+/*
+ * Instrumentation, enabled with stats=json or 2CCA_STATS=json
+ * Each issuance, revocation or DH generation prints one JSON line on
+ * stderr with the time spent in every stage and the bytes written.
+ * Counters and latency histograms accumulate over the whole run and are
+ * printed at the end of a batch, or on request in serve mode.
+ */
+#define STATS_STAGES    16
+#define STATS_BUCKETS   28      /* log2 of latency in usec */
 
-    ca->key = EVP_PKEY_new();
-    EVP_PKEY_assign_RSA(ca->key, rsa);
+typedef struct _stage_stats_ {
+    char   name[24] ;
+    double usec ;
+    long   bytes ;
+} stage_stats ;
 
-    if (!X509_check_private_key(ca->cert, ca->key)) {
-        fprintf(stderr, "CA certificate and private key do not match\n");
-        return -1 ;
+typedef struct _op_total_ {
+    char   op[16] ;
+    long   count ;
+    long   failed ;
+    double usec ;
+    double max_usec ;
+    long   hist[STATS_BUCKETS] ;
+    stage_stats stage[STATS_STAGES] ;
+    int    n_stages ;
+} op_total ;
+
+static int stats_on = 0 ;
+
+typedef struct _op_state_ {
+    char   op[16] ;
+    char   name[FIELD_SZ+1] ;
+    double start ;
+    stage_stats stage[STATS_STAGES] ;
+    int    n_stages ;
+    int    depth ;
+} op_state ;
+
+static op_state op_stats ;
+
+static op_total op_totals[4] ;
+static int n_op_totals = 0 ;
+
+static void stats_begin(char * op, char * name)
+{
+    if (!stats_on || op_stats.depth++>0)
+        return ;
+    memset(op_stats.stage, 0, sizeof(op_stats.stage));
+    op_stats.n_stages = 0 ;
+    snprintf(op_stats.op, sizeof(op_stats.op), "%s", op);
+    snprintf(op_stats.name, sizeof(op_stats.name), "%s", name);
+    op_stats.start = now_usec();
+}
+
+static void stage_add(stage_stats * stages, int * n, char * name,
+                      double usec, long bytes)
+{
+    int i ;
+
+    for (i=0 ; i<*n ; i++) {
+        if (!strcmp(stages[i].name, name))
+            break ;
     }
-    return 0;
+    if (i==*n) {
+        if (*n>=STATS_STAGES)
+            return ;
+        snprintf(stages[i].name, sizeof(stages[i].name), "%s", name);
+        (*n)++;
+    }
+    stages[i].usec  += usec ;
+    stages[i].bytes += bytes ;
 }
 
 /*
- * Create identity
+ * Account time since t0 (from now_usec) to a stage of the current operation
  */
-int build_identity(void)
+static void stats_stage(char * name, double t0, long bytes)
 {
-    EVP_PKEY * pkey ;
-    RSA * rsa ;
-    EC_KEY * ecc ;
-    X509 * cert ;
-    X509_NAME * name ;
-    identity ca ;
-    char filename[FIELD_SZ+5];
-    FILE * pem ;
+    if (!stats_on || op_stats.depth==0)
+        return ;
+    stage_add(op_stats.stage, &op_stats.n_stages, name, now_usec()-t0, bytes);
+}
 
-    /* Check before overwriting */
-    sprintf(filename, "%s.crt", certinfo.cn);
-    if (access(filename, F_OK)!=-1) {
-        fprintf(stderr, "identity named %s already exists in this directory. Exiting now\n", filename);
-        return -1 ;
-    }
-    sprintf(filename, "%s.key", certinfo.cn);
-    if (access(filename, F_OK)!=-1) {
-        fprintf(stderr, "identity named %s already exists in this directory. Exiting now\n", filename);
-        return -1 ;
-    }
+/*
+ * Put the current operation aside while others are accounted, e.g.
+ * between building and writing the identities of a batch window
+ */
+static void stats_suspend(op_state * saved)
+{
+    if (!stats_on)
+        return ;
+    *saved = op_stats ;
+    op_stats.depth = 0 ;
+}
 
-    switch (certinfo.profile) {
-        case PROFILE_ROOT_CA:
-        strcpy(certinfo.ou, "Root");
-        break;
+static void stats_resume(op_state * saved)
+{
+    if (!stats_on)
+        return ;
+    op_stats = *saved ;
+}
 
-        case PROFILE_SUB_CA:
-        strcpy(certinfo.ou, "Sub");
-        break;
+static void json_string(FILE * out, char * s)
+{
+    fputc('"', out);
+    for ( ; *s ; s++) {
+        if (*s=='"' || *s=='\\') {
+            fprintf(out, "\\%c", *s);
+        } else if ((unsigned char)*s<0x20) {
+            fprintf(out, "\\u%04x", *s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
 
-        case PROFILE_SERVER:
-        strcpy(certinfo.ou, "Server");
-        break;
-        
-        case PROFILE_CLIENT:
-        strcpy(certinfo.ou, "Client");
-        break;
+static void stats_end(int ret)
+{
+    op_total * t=NULL ;
+    double usec ;
+    int i, b ;
 
-        case PROFILE_WWW:
-        strcpy(certinfo.ou, "Server");
-        break;
+    if (!stats_on || --op_stats.depth>0)
+        return ;
+    usec = now_usec()-op_stats.start ;
 
-        default:
-        fprintf(stderr, "Unknown profile: aborting\n");
-        return -1 ;
+    fprintf(stderr, "{\"op\":\"%s\",\"name\":", op_stats.op);
+    json_string(stderr, op_stats.name);
+    fprintf(stderr, ",\"ok\":%s,\"total_us\":%.1f", ret==0 ? "true" : "false", usec);
+    for (i=0 ; i<op_stats.n_stages ; i++) {
+        fprintf(stderr, ",\"%s_us\":%.1f", op_stats.stage[i].name, op_stats.stage[i].usec);
+        if (op_stats.stage[i].bytes)
+            fprintf(stderr, ",\"%s_bytes\":%ld", op_stats.stage[i].name, op_stats.stage[i].bytes);
     }
+    fprintf(stderr, "}\n");
 
-    if (certinfo.ec_name[0] && certinfo.profile!=PROFILE_CLIENT) {
-        fprintf(stderr, "ECC keys are only supported for clients\n");
-        return -1 ;
+    /* Cumulative counters */
+    for (i=0 ; i<n_op_totals ; i++) {
+        if (!strcmp(op_totals[i].op, op_stats.op))
+            t = &op_totals[i] ;
     }
-
-    if (certinfo.profile != PROFILE_ROOT_CA) {
-        /* Need to load signing CA */
-        if (load_ca(certinfo.signing_ca, &ca)!=0) {
-            fprintf(stderr, "Cannot find CA key or certificate\n");
-            return -1 ;
-        }
-        /* Organization is the same as root */
-        X509_NAME_get_text_by_NID(X509_get_subject_name(ca.cert),
-                                  NID_organizationName,
-                                  certinfo.o,
-                                  FIELD_SZ);
+    if (!t) {
+        if (n_op_totals>=(int)(sizeof(op_totals)/sizeof(op_totals[0])))
+            return ;
+        t = &op_totals[n_op_totals++] ;
+        strcpy(t->op, op_stats.op);
     }
-
-    /* Generate key pair */
-    if (certinfo.ec_name[0]) {
-        printf("Generating EC key [%s]\n", certinfo.ec_name);
-        ecc = EC_KEY_new_by_curve_name(OBJ_txt2nid(certinfo.ec_name));
-        if (!ecc) {
-            fprintf(stderr, "Unknown curve: [%s]\n", certinfo.ec_name);
-            return -1 ;
-        }
-        EC_KEY_set_asn1_flag(ecc, OPENSSL_EC_NAMED_CURVE);
-        EC_KEY_generate_key(ecc);
-        pkey = EVP_PKEY_new();
-        EVP_PKEY_assign_EC_KEY(pkey, ecc);
-    } else {
-        printf("Generating RSA-%d key\n", certinfo.rsa_keysz);
-        pkey = EVP_PKEY_new();
-        rsa = RSA_generate_key(certinfo.rsa_keysz, RSA_F4, progress, 0);
-        EVP_PKEY_assign_RSA(pkey, rsa);
+    t->count++;
+    if (ret!=0)
+        t->failed++;
+    t->usec += usec ;
+    if (usec>t->max_usec)
+        t->max_usec = usec ;
+    for (b=0 ; b<STATS_BUCKETS-1 && (1L<<b)<usec ; b++)
+        ;
+    t->hist[b]++;
+    for (i=0 ; i<op_stats.n_stages ; i++) {
+        stage_add(t->stage, &t->n_stages, op_stats.stage[i].name,
+                  op_stats.stage[i].usec, op_stats.stage[i].bytes);
     }
+}
 
-    /* Assign all certificate fields */
-    cert = X509_new();
-    X509_set_version(cert, 2);
-    set_serial128(cert);
-    X509_gmtime_adj(X509_get_notBefore(cert), 0);
-    X509_gmtime_adj(X509_get_notAfter(cert), certinfo.days * 24*60*60);
-    X509_set_pubkey(cert, pkey);
+/*
+ * Cumulative counters as one JSON object. Histogram buckets are keyed by
+ * their upper bound in usec.
+ */
+static void stats_summary(FILE * out)
+{
+    op_total * t ;
+    int i, j, first ;
 
-    name = X509_get_subject_name(cert);
-    if (certinfo.c[0]) {
-        X509_NAME_add_entry_by_txt(name, "C", MBSTRING_ASC, (unsigned char*)certinfo.c, -1, -1, 0);
-    }
-    X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC, (unsigned char*)certinfo.o, -1, -1, 0);
-    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char*)certinfo.cn, -1, -1, 0);
-    X509_NAME_add_entry_by_txt(name, "OU", MBSTRING_ASC, (unsigned char*)certinfo.ou, -1, -1, 0);
-    if (certinfo.l[0]) {
-        X509_NAME_add_entry_by_txt(name, "L", MBSTRING_ASC, (unsigned char *)certinfo.l, -1, -1, 0);
-    }
-    if (certinfo.st[0]) {
-        X509_NAME_add_entry_by_txt(name, "ST", MBSTRING_ASC, (unsigned char *)certinfo.st, -1, -1, 0);
+    fprintf(out, "{\"op\":\"summary\"");
+    for (i=0 ; i<n_op_totals ; i++) {
+        t = &op_totals[i] ;
+        fprintf(out, ",\"%s\":{\"count\":%ld,\"failed\":%ld,\"total_us\":%.1f,"
+                     "\"max_us\":%.1f,\"hist_us\":{",
+                t->op, t->count, t->failed, t->usec, t->max_usec);
+        for (j=0, first=1 ; j<STATS_BUCKETS ; j++) {
+            if (!t->hist[j])
+                continue ;
+            fprintf(out, "%s\"%ld\":%ld", first ? "" : ",", 1L<<j, t->hist[j]);
+            first = 0 ;
+        }
+        fprintf(out, "}");
+        for (j=0 ; j<t->n_stages ; j++) {
+            fprintf(out, ",\"%s_us\":%.1f", t->stage[j].name, t->stage[j].usec);
+            if (t->stage[j].bytes)
+                fprintf(out, ",\"%s_bytes\":%ld", t->stage[j].name, t->stage[j].bytes);
+        }
+        fprintf(out, "}");
     }
+    fprintf(out, "}\n");
+}
 
-    /* Set extensions according to profile */
-    switch (certinfo.profile) {
-        case PROFILE_ROOT_CA:
-        /* CA profiles can issue certs and sign CRLS */
-        set_extension(cert, cert, NID_basic_constraints, "critical,CA:TRUE");
-        set_extension(cert, cert, NID_key_usage, "critical,keyCertSign,cRLSign");
-        set_extension(cert, cert, NID_subject_key_identifier, "hash");
-        set_extension(cert, cert, NID_authority_key_identifier, "keyid:always");
-        break ;
+/*
+ * Output files are written with a single write() to a temporary name,
+ * then renamed over the target: readers never see a partial file and a
+ * crash leaves either the old or the new version.
+ * Each file is synced before being renamed, unless writes are grouped
+ * with write_group_begin(): renames are then deferred to
+ * write_group_end(), which syncs them all at once.
+ * Files that must not exist yet are written with create_bio(): they are
+ * published with link() instead, which fails if the name is taken.
+ */
+#define PATH_SZ     (4*FIELD_SZ+32)
 
-        case PROFILE_SUB_CA:
-        /* CA profiles can issue certs and sign CRLS */
-        set_extension(ca.cert, cert, NID_basic_constraints, "critical,CA:TRUE");
-        set_extension(ca.cert, cert, NID_key_usage, "critical,keyCertSign,cRLSign");
-        set_extension(ca.cert, cert, NID_subject_key_identifier, "hash");
-        set_extension(ca.cert, cert, NID_authority_key_identifier, "keyid:always");
-        break;
-
-        case PROFILE_CLIENT:
-        if (certinfo.san[0]) {
-            set_extension(ca.cert, cert, NID_subject_alt_name, certinfo.san);
-        }
-        set_extension(ca.cert, cert, NID_basic_constraints, "CA:FALSE");
-        set_extension(ca.cert, cert, NID_anyExtendedKeyUsage, "clientAuth");
-        set_extension(ca.cert, cert, NID_key_usage, "digitalSignature");
-        set_extension(ca.cert, cert, NID_subject_key_identifier, "hash");
-        set_extension(ca.cert, cert, NID_authority_key_identifier, "issuer:always,keyid:always");
-        break ;
+typedef struct _pending_write_ {
+    char tmp[PATH_SZ] ;
+    char name[PATH_SZ] ;
+    int  create ;           /* name must not exist yet */
+} pending_write ;
 
-        case PROFILE_SERVER:
-        if (certinfo.san[0]) {
-            set_extension(ca.cert, cert, NID_subject_alt_name, certinfo.san);
-        }
-        set_extension(ca.cert, cert, NID_basic_constraints, "CA:FALSE");
-        set_extension(ca.cert, cert, NID_netscape_cert_type, "server");
-        set_extension(ca.cert, cert, NID_anyExtendedKeyUsage, "serverAuth");
-        set_extension(ca.cert, cert, NID_key_usage, "digitalSignature,keyEncipherment");
-        set_extension(ca.cert, cert, NID_subject_key_identifier, "hash");
-        set_extension(ca.cert, cert, NID_authority_key_identifier, "issuer:always,keyid:always");
-        break ;
+static pending_write * pending = NULL ;
+static int n_pending=0, sz_pending=0, grouping=0 ;
+/* Names of the last group, those that could not be published first */
+static int n_grouped=0, n_unpublished=0 ;
 
-        case PROFILE_WWW:
-        if (certinfo.san[0]) {
-            set_extension(ca.cert, cert, NID_subject_alt_name, certinfo.san);
-        }
-        set_extension(ca.cert, cert, NID_basic_constraints, "CA:FALSE");
-        set_extension(ca.cert, cert, NID_netscape_cert_type, "server");
-        set_extension(ca.cert, cert, NID_anyExtendedKeyUsage, "serverAuth,clientAuth");
-        set_extension(ca.cert, cert, NID_key_usage, "digitalSignature,keyEncipherment");
-        set_extension(ca.cert, cert, NID_subject_key_identifier, "hash");
-        set_extension(ca.cert, cert, NID_authority_key_identifier, "issuer:always,keyid:always");
-        break;
+static void dir_of(char * filename, char * dir)
+{
+    char * slash ;
 
-        case PROFILE_UNKNOWN:
-        default:
-        break ;
-    }
-    /* Set issuer */
-    if (certinfo.profile==PROFILE_ROOT_CA) {
-        /* Self-signed */
-        X509_set_issuer_name(cert, name);
-        X509_sign(cert, pkey, EVP_sha256());
+    strcpy(dir, filename);
+    if ((slash=strrchr(dir, '/'))==NULL) {
+        strcpy(dir, ".");
+    } else if (slash==dir) {
+        dir[1] = 0 ;
     } else {
-        /* Signed by parent CA */
-        X509_set_issuer_name(cert, X509_get_subject_name(ca.cert));
-        X509_sign(cert, ca.key, EVP_sha256());
-    }
-
-    printf("Saving results to %s.[crt|key]\n", certinfo.cn);
-    pem = fopen(filename, "wb");
-    PEM_write_PrivateKey(pem, pkey, NULL, NULL, 0, NULL, NULL);
-    fclose(pem);
-    sprintf(filename, "%s.crt", certinfo.cn);
-    pem = fopen(filename, "wb");
-    PEM_write_X509(pem, cert);
-    fclose(pem);
-    X509_free(cert);
-    EVP_PKEY_free(pkey);
-
-    if (certinfo.profile!=PROFILE_ROOT_CA) {
-        X509_free(ca.cert);
-        EVP_PKEY_free(ca.key);
+        *slash = 0 ;
     }
-    printf("done\n");
-
-    return 0;
 }
 
-static X509_CRL * load_crl(char * ca_name)
+/*
+ * Make renames in a directory durable
+ */
+static void sync_dir(char * filename)
 {
-    FILE * fp ;
-    BIO  * in ;
-    X509_CRL * crl ;
-    char filename[FIELD_SZ+5];
+    char dir[PATH_SZ];
+    int  fd ;
 
-    sprintf(filename, "%s.crl", ca_name);
-    in = BIO_new(BIO_s_file());
-    if ((fp=fopen(filename, "rb"))==NULL) {
-        BIO_free(in);
-        return NULL ;
+    dir_of(filename, dir);
+    if ((fd=open(dir, O_RDONLY))>=0) {
+        fsync(fd);
+        close(fd);
     }
-    BIO_set_fp(in, fp, BIO_NOCLOSE);
-    crl = PEM_read_bio_X509_CRL(in, NULL, NULL, NULL);
-    fclose(fp);
-    BIO_free(in);
-    return crl ;
 }
 
 /*
- * openssl crl -in ca.crl -text
+ * Create missing parent directories of filename
  */
-void show_crl(char * ca_name)
+static int make_parents(char * filename)
 {
-    X509_CRL * crl ;
-    X509_REVOKED * rev ;
-    int i, total ;
-    STACK_OF(X509_REVOKED) * rev_list ;
-    BIO * out ;
+    char dir[PATH_SZ];
+    char * p ;
+    char c ;
 
-    if ((crl = load_crl(ca_name))==NULL) {
-        printf("No CRL found\n");
-        return ;
+    dir_of(filename, dir);
+    for (p=dir+1 ; ; p++) {
+        if (*p=='/' || *p==0) {
+            c = *p ;
+            *p = 0 ;
+            if (mkdir(dir, 0755)!=0 && errno!=EEXIST)
+                return -1 ;
+            if ((*p=c)==0)
+                break ;
+        }
     }
-    rev_list = X509_CRL_get_REVOKED(crl);
-    total = sk_X509_REVOKED_num(rev_list);
+    return 0 ;
+}
 
-    out = BIO_new(BIO_s_file());
-    out = BIO_new_fp(stdout, BIO_NOCLOSE);
+/*
+ * Move a written temporary file to its name, see write_file()
+ */
+static int publish_file(char * tmp, char * filename, int create)
+{
+    int ret ;
 
-    BIO_printf(out, "-- Revoked certificates found in CRL\n");
-    for (i=0 ; i<total ; i++) {
-        rev=sk_X509_REVOKED_value(rev_list, i);
-        BIO_printf(out, "serial: ");
-        i2a_ASN1_INTEGER(out, rev->serialNumber);
-        BIO_printf(out, "\n  date: ");
-        ASN1_TIME_print(out, rev->revocationDate);
-        BIO_printf(out, "\n\n");
-    }
-    X509_CRL_free(crl);
-    BIO_free_all(out);
-    return ;
+    if (!create)
+        return rename(tmp, filename);
+    if ((ret=link(tmp, filename))!=0 && errno==EEXIST)
+        fprintf(stderr, "%s already exists\n", filename);
+    unlink(tmp);
+    return ret ;
 }
 
 /*
- * Revoke one certificate at a time
- * No check performed to see if certificate already revoked.
+ * Write len bytes to filename with the given mode. With create set the
+ * file is only published if filename does not exist.
+ * Returns the number of bytes written or -1.
  */
-void revoke_cert(char * ca_name, char * name)
+static long put_file(char * filename, const char * data, long len, int mode, int create)
 {
-    char filename[FIELD_SZ+5];
-    FILE * f ;
-    X509_CRL * crl ;
-    X509 * cert ;
-    ASN1_INTEGER * r_serial ;
-    ASN1_INTEGER * crlnum ;
-    X509_REVOKED * rev ;
-    ASN1_TIME * tm ;
-    identity ca ;
-    BIO * out ;
-    BIGNUM * b_crlnum ;
+    static int seq=0 ;
+    char tmp[PATH_SZ];
+    long done ;
+    int  fd, n ;
 
-    /* Find requested certificate by name */
-    sprintf(filename, "%s.crt", name);
-    if ((f=fopen(filename, "r"))==NULL) {
-        fprintf(stderr, "Cannot find: %s\n", filename);
-        return ; 
+    snprintf(tmp, sizeof(tmp), "%s.tmp-%ld-%d", filename, (long)getpid(), seq++);
+    if ((fd=open(tmp, O_WRONLY|O_CREAT|O_EXCL, mode))<0 && errno==ENOENT &&
+        make_parents(filename)==0) {
+        fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL, mode);
     }
-    cert = PEM_read_X509(f, NULL, NULL, NULL);
-    fclose(f);
-    /* Get certificate serial number */
-    r_serial = X509_get_serialNumber(cert);
+    if (fd<0) {
+        fprintf(stderr, "Cannot write %s\n", filename);
+        return -1 ;
+    }
+    for (done=0 ; done<len ; done+=n) {
+        if ((n=write(fd, data+done, len-done))<=0)
+            break ;
+    }
+    if (done<len || (!grouping && fsync(fd)!=0)) {
+        fprintf(stderr, "Cannot write %s\n", filename);
+        close(fd);
+        unlink(tmp);
+        return -1 ;
+    }
+    close(fd);
 
-    /* Find out if if was already revoked */
+    if (grouping) {
+        if (n_pending==sz_pending) {
+            sz_pending = sz_pending ? 2*sz_pending : 64 ;
+            pending = realloc(pending, sz_pending * sizeof(pending_write));
+        }
+        strcpy(pending[n_pending].tmp, tmp);
+        strcpy(pending[n_pending].name, filename);
+        pending[n_pending].create = create ;
+        n_pending++;
+        return len ;
+    }
+    if (publish_file(tmp, filename, create)!=0) {
+        fprintf(stderr, "Cannot write %s\n", filename);
+        unlink(tmp);
+        return -1 ;
+    }
+    sync_dir(filename);
+    return len ;
+}
 
-    /* Make a revoked object with that serial */
-    rev = X509_REVOKED_new();
-    X509_REVOKED_set_serialNumber(rev, r_serial);
-    X509_free(cert);
-    /* Set reason to unspecified */
-    rev->reason = ASN1_ENUMERATED_get(CRL_REASON_UNSPECIFIED);
+static long write_file(char * filename, const char * data, long len, int mode)
+{
+    return put_file(filename, data, len, mode, 0);
+}
 
-    /* Load or create new CRL */
-    if ((crl = load_crl(ca_name))==NULL) {
-        crl = X509_CRL_new();
-        X509_CRL_set_version(crl, 1);
-        /* Set CRL number */
-        crlnum = ASN1_INTEGER_new();
-        ASN1_INTEGER_set(crlnum, 1);
-        X509_CRL_add1_ext_i2d(crl, NID_crl_number, crlnum, 0, 0);
-        ASN1_INTEGER_free(crlnum);
-    } else {
-        crlnum = X509_CRL_get_ext_d2i(crl, NID_crl_number, 0, 0);
-        b_crlnum = ASN1_INTEGER_to_BN(crlnum, NULL);
-        BN_add_word(b_crlnum, 1);
-        BN_to_ASN1_INTEGER(b_crlnum, crlnum);
-        BN_free(b_crlnum);
-        X509_CRL_add1_ext_i2d(crl, NID_crl_number, crlnum, 0, X509V3_ADD_REPLACE_EXISTING);
-        ASN1_INTEGER_free(crlnum);
-    }
+/*
+ * Write the contents of a memory BIO, see write_file()
+ */
+static long write_bio(char * filename, BIO * mem, int mode)
+{
+    char * data ;
+    long   len ;
 
-    /* What time is it? */
-    tm = ASN1_TIME_new();
-    X509_gmtime_adj(tm, 0);
-    X509_REVOKED_set_revocationDate(rev, tm);
-    X509_CRL_set_lastUpdate(crl, tm);
+    len = BIO_get_mem_data(mem, &data);
+    return put_file(filename, data, len, mode, 0);
+}
 
-    /* Set CRL next update to a year from now */
-    X509_gmtime_adj(tm, 365*24*60*60);
-    X509_CRL_set_nextUpdate(crl, tm);
-    ASN1_TIME_free(tm);
+/*
+ * Write the contents of a memory BIO to a file that does not exist yet
+ */
+static long create_bio(char * filename, BIO * mem, int mode)
+{
+    char * data ;
+    long   len ;
 
-    /* Add revoked to CRL */
-    X509_CRL_add0_revoked(crl, rev);    
-    X509_CRL_sort(crl);
+    len = BIO_get_mem_data(mem, &data);
+    return put_file(filename, data, len, mode, 1);
+}
 
-    /* Load root key to sign CRL */
-    if (load_ca(ca_name, &ca)!=0) {
-        fprintf(stderr, "Cannot find CA key/crt\n");
-        return ;
+/*
+ * Scratch buffer files are encoded into before they are written. Files
+ * are only written from the main thread, so a single memory BIO is
+ * emptied and reused: its storage grows to the largest file once, and
+ * issuing does not allocate a buffer per file.
+ * Emptying also wipes the previous contents, private keys included.
+ */
+static BIO * out_buffer(void)
+{
+    static BIO * mem=NULL ;
+
+    if (!mem) {
+        mem = BIO_new(BIO_s_mem());
+    } else {
+        (void)BIO_reset(mem);
     }
-    X509_CRL_set_issuer_name(crl, X509_get_subject_name(ca.cert));
-    X509_free(ca.cert);
+    return mem ;
+}
 
-    /* Sign CRL */
-    X509_CRL_sign(crl, ca.key, EVP_sha256());
+/*
+ * True if filename exists, or is about to once the current group ends
+ */
+static int file_exists(char * filename)
+{
+    int i ;
+
+    for (i=0 ; i<n_pending ; i++) {
+        if (!strcmp(pending[i].name, filename))
+            return 1 ;
+    }
+    return access(filename, F_OK)!=-1 ;
+}
+
+/*
+ * Names held for files about to be written with create_bio(), so that
+ * two identities of the same run cannot both start with one name. Claims
+ * only live in memory: between processes, create_bio() decides.
+ */
+static char (* claims)[PATH_SZ] = NULL ;
+static int n_claims=0, sz_claims=0 ;
+
+/*
+ * Returns 0 if the name was claimed, -1 if it is taken.
+ */
+static int claim_file(char * filename)
+{
+    int i ;
+
+    if (file_exists(filename))
+        return -1 ;
+    for (i=0 ; i<n_claims ; i++) {
+        if (!strcmp(claims[i], filename))
+            return -1 ;
+    }
+    if (n_claims==sz_claims) {
+        sz_claims = sz_claims ? 2*sz_claims : 64 ;
+        claims = realloc(claims, sz_claims * sizeof(*claims));
+    }
+    strcpy(claims[n_claims++], filename);
+    return 0 ;
+}
+
+/*
+ * Give back a name claimed with claim_file(), written or not
+ */
+static void unclaim_file(char * filename)
+{
+    int i ;
+
+    for (i=0 ; i<n_claims ; i++) {
+        if (!strcmp(claims[i], filename)) {
+            if (i<--n_claims)
+                strcpy(claims[i], claims[n_claims]);
+            return ;
+        }
+    }
+}
+
+/*
+ * Take back a file written for a job that failed: a grouped write is
+ * dropped before it is published. With published set, a file that was
+ * already published is removed.
+ */
+static void write_cancel(char * filename, int published)
+{
+    int i ;
+
+    for (i=0 ; i<n_pending ; i++) {
+        if (!strcmp(pending[i].name, filename)) {
+            unlink(pending[i].tmp);
+            n_pending--;
+            memmove(&pending[i], &pending[i+1], (n_pending-i) * sizeof(pending_write));
+            return ;
+        }
+    }
+    if (published)
+        unlink(filename);
+}
+
+static void write_group_begin(void)
+{
+    grouping = 1 ;
+    n_grouped = n_unpublished = 0 ;
+}
+
+/*
+ * Sync and publish all files written since write_group_begin().
+ * Returns the number of files that could not be published, see
+ * write_group_status() for their names.
+ */
+static int write_group_end(void)
+{
+    char dir[PATH_SZ];
+    char last[PATH_SZ]="" ;
+    pending_write swap ;
+    int  i, fd, failed=0 ;
+
+    grouping = 0 ;
+    n_grouped = n_unpublished = 0 ;
+    if (n_pending==0)
+        return 0 ;
+    /* One sync for the whole group */
+#ifdef __linux__
+    dir_of(pending[0].tmp, dir);
+    if ((fd=open(dir, O_RDONLY))>=0) {
+        syncfs(fd);
+        close(fd);
+    }
+#else
+    sync();
+#endif
+    for (i=0 ; i<n_pending ; i++) {
+        if (publish_file(pending[i].tmp, pending[i].name, pending[i].create)!=0) {
+            fprintf(stderr, "Cannot write %s\n", pending[i].name);
+            unlink(pending[i].tmp);
+            /* Move it with the other failures to the front */
+            swap = pending[failed] ;
+            pending[failed++] = pending[i] ;
+            pending[i] = swap ;
+        }
+    }
+    for (i=failed ; i<n_pending ; i++) {
+        dir_of(pending[i].name, dir);
+        if (strcmp(dir, last)) {
+            sync_dir(pending[i].name);
+            strcpy(last, dir);
+        }
+    }
+    n_grouped = n_pending ;
+    n_unpublished = failed ;
+    n_pending = 0 ;
+    return failed ;
+}
+
+/*
+ * Outcome of filename in the last group: 1 if it was published, -1 if it
+ * could not be, 0 if it was not part of the group.
+ */
+static int write_group_status(char * filename)
+{
+    int i ;
+
+    for (i=0 ; i<n_grouped ; i++) {
+        if (!strcmp(pending[i].name, filename))
+            return i<n_unpublished ? -1 : 1 ;
+    }
+    return 0 ;
+}
+
+/*
+ * Store layout. By default all files are NAME.ext in the current directory.
+ * With store=DIR they are sharded per CA, then by the first four hex
+ * digits of SHA-256(CN):
+ *   DIR/CA/CA.crt, CA.key, CA.crl, ...   a CA and its CRLs
+ *   DIR/CA/ab/cd/CN.crt, CN.key          identities signed by CA
+ *   DIR/2cca.idx                         the index
+ */
+static char * ca_file(char * ca_name, char * suffix, char * path)
+{
+    if (store_dir[0]) {
+        snprintf(path, PATH_SZ, "%s/%s/%s%s", store_dir, ca_name, ca_name, suffix);
+    } else {
+        snprintf(path, PATH_SZ, "%s%s", ca_name, suffix);
+    }
+    return path ;
+}
+
+static char * leaf_file(char * ca_name, char * cn, char * suffix, char * path)
+{
+    unsigned char md[SHA256_DIGEST_LENGTH];
+
+    if (store_dir[0]) {
+        SHA256((unsigned char *)cn, strlen(cn), md);
+        snprintf(path, PATH_SZ, "%s/%s/%02x/%02x/%s%s",
+                 store_dir, ca_name, md[0], md[1], cn, suffix);
+    } else {
+        snprintf(path, PATH_SZ, "%s%s", cn, suffix);
+    }
+    return path ;
+}
+
+/*
+ * Certificate for name, an identity or a sub CA signed by ca_name
+ */
+static char * crt_file(char * ca_name, char * name, char * path)
+{
+    leaf_file(ca_name, name, ".crt", path);
+    if (store_dir[0] && access(path, F_OK)!=0)
+        ca_file(name, ".crt", path);
+    return path ;
+}
+
+/*
+ * Cut a line into blank-separated words. Single or double quotes can be
+ * used to keep blanks inside a word. Returns the number of words found.
+ */
+static int split_line(char * line, char ** words, int max)
+{
+    int  n=0 ;
+    char quote ;
+    char * dst ;
+
+    while (*line && n<max) {
+        while (*line==' ' || *line=='\t' || *line=='\n' || *line=='\r')
+            line++;
+        if (*line==0 || *line=='#')
+            break ;
+        words[n++] = dst = line ;
+        quote = 0 ;
+        while (*line) {
+            if (quote) {
+                if (*line==quote) {
+                    quote=0 ;
+                    line++;
+                    continue ;
+                }
+            } else if (*line=='"' || *line=='\'') {
+                quote = *line++;
+                continue ;
+            } else if (*line==' ' || *line=='\t' || *line=='\n' || *line=='\r') {
+                break ;
+            }
+            *dst++ = *line++;
+        }
+        if (*line)
+            line++;
+        *dst = 0 ;
+    }
+    return n ;
+}
+
+/*
+ * Certificate profiles. Extensions that are the same for every
+ * certificate of a profile are encoded once per run and copied into each
+ * new certificate; only SAN, SKI and AKI are computed per certificate.
+ * Built-in profiles sit at the index of their PROFILE_ value, profiles
+ * loaded with profiles=FILE are added from PROFILE_CUSTOM on.
+ */
+#define MAX_PROFILES    32
+#define MAX_PROFILE_EXT 16
+
+#define KEYS_ANY    0
+#define KEYS_RSA    1   /* only for RSA keys */
+#define KEYS_NO_RSA 2   /* only for other keys */
+
+typedef struct _ext_conf_ {
+    int    nid ;
+    int    keys ;
+    char * value ;
+} ext_conf ;
+
+typedef struct _cert_profile_ {
+    char * name ;
+    char * ou ;
+    int    n ;
+    ext_conf conf[MAX_PROFILE_EXT] ;
+    STACK_OF(X509_EXTENSION) * exts[2] ;    /* encoded for other keys, RSA keys */
+} cert_profile ;
+
+static cert_profile profiles[MAX_PROFILES] = {
+    { NULL, NULL, 0, {{0}}, {NULL} },
+    { "root", "Root", 2, {
+        { NID_basic_constraints, KEYS_ANY, "critical,CA:TRUE" },
+        { NID_key_usage,         KEYS_ANY, "critical,keyCertSign,cRLSign" },
+    }, {NULL} },
+    { "sub", "Sub", 2, {
+        { NID_basic_constraints, KEYS_ANY, "critical,CA:TRUE" },
+        { NID_key_usage,         KEYS_ANY, "critical,keyCertSign,cRLSign" },
+    }, {NULL} },
+    { "server", "Server", 5, {
+        { NID_basic_constraints,  KEYS_ANY,    "CA:FALSE" },
+        { NID_netscape_cert_type, KEYS_ANY,    "server" },
+        { NID_ext_key_usage,      KEYS_ANY,    "serverAuth" },
+        { NID_key_usage,          KEYS_RSA,    "digitalSignature,keyEncipherment" },
+        { NID_key_usage,          KEYS_NO_RSA, "digitalSignature" },
+    }, {NULL} },
+    { "client", "Client", 3, {
+        { NID_basic_constraints, KEYS_ANY, "CA:FALSE" },
+        { NID_ext_key_usage,     KEYS_ANY, "clientAuth" },
+        { NID_key_usage,         KEYS_ANY, "digitalSignature" },
+    }, {NULL} },
+    { "www", "Server", 5, {
+        { NID_basic_constraints,  KEYS_ANY,    "CA:FALSE" },
+        { NID_netscape_cert_type, KEYS_ANY,    "server" },
+        { NID_ext_key_usage,      KEYS_ANY,    "serverAuth,clientAuth" },
+        { NID_key_usage,          KEYS_RSA,    "digitalSignature,keyEncipherment" },
+        { NID_key_usage,          KEYS_NO_RSA, "digitalSignature" },
+    }, {NULL} },
+} ;
+static int n_profiles = PROFILE_CUSTOM ;
+
+/* Command names that cannot be used for custom profiles */
+static const char * reserved_names[] = {
+    "batch", "sign", "renew", "serve", "ocsp", "keypool", "list", "find", "proof", "status",
+    "bench", "crl", "revoke", "revoke-list", "crl-base", "crl-merge", "dh", "stats", "quit",
+    NULL
+} ;
+
+static cert_profile * profile_of(struct _certinfo_ * info)
+{
+    if (info->profile==PROFILE_CUSTOM)
+        return &profiles[info->custom] ;
+    return &profiles[info->profile] ;
+}
+
+/*
+ * Extensions of a profile for a key type, encoded on first use
+ */
+static STACK_OF(X509_EXTENSION) * profile_exts(cert_profile * p, int rsa)
+{
+    X509_EXTENSION * ext ;
+    int i ;
+
+    if (p->exts[rsa])
+        return p->exts[rsa] ;
+    p->exts[rsa] = sk_X509_EXTENSION_new_null();
+    for (i=0 ; i<p->n ; i++) {
+        if ((p->conf[i].keys==KEYS_RSA && !rsa) ||
+            (p->conf[i].keys==KEYS_NO_RSA && rsa))
+            continue ;
+        if ((ext=X509V3_EXT_conf_nid(NULL, NULL, p->conf[i].nid, p->conf[i].value))!=NULL)
+            sk_X509_EXTENSION_push(p->exts[rsa], ext);
+    }
+    return p->exts[rsa] ;
+}
+
+/*
+ * Read profile definitions, one extension per line:
+ *   NAME EXTENSION VALUE
+ * where EXTENSION is an OpenSSL extension name such as keyUsage or
+ * extendedKeyUsage, and VALUE uses the openssl.cnf syntax. The pseudo
+ * extension OU sets the organizational unit (default: the profile name).
+ * Lines for a built-in name replace all of its extensions. New names
+ * are leaf certificate profiles, usable as commands and batch types.
+ */
+static int profiles_load(char * filename)
+{
+    FILE * f ;
+    char line[BATCH_LINE];
+    char * words[4];
+    int seen[MAX_PROFILES];
+    X509_EXTENSION * ext ;
+    cert_profile * p ;
+    int i, nid, lineno=0, ret=0 ;
+
+    if ((f=fopen(filename, "r"))==NULL) {
+        fprintf(stderr, "Cannot open profiles: %s\n", filename);
+        return -1 ;
+    }
+    memset(seen, 0, sizeof(seen));
+    while (ret==0 && fgets(line, BATCH_LINE, f)) {
+        lineno++;
+        if ((i=split_line(line, words, 4))==0)
+            continue ;
+        if (i!=3 || strlen(words[0])>FIELD_SZ || strlen(words[2])>FIELD_SZ) {
+            fprintf(stderr, "%s:%d: expected NAME EXTENSION VALUE\n", filename, lineno);
+            ret = -1 ;
+            break ;
+        }
+        for (i=0 ; reserved_names[i] && strcmp(words[0], reserved_names[i]) ; i++)
+            ;
+        if (reserved_names[i]) {
+            fprintf(stderr, "%s:%d: [%s] is a command name\n", filename, lineno, words[0]);
+            ret = -1 ;
+            break ;
+        }
+        for (i=PROFILE_ROOT_CA ; i<n_profiles && strcmp(words[0], profiles[i].name) ; i++)
+            ;
+        if (i==n_profiles) {
+            if (n_profiles>=MAX_PROFILES) {
+                fprintf(stderr, "%s:%d: too many profiles\n", filename, lineno);
+                ret = -1 ;
+                break ;
+            }
+            profiles[i].name = strdup(words[0]);
+            profiles[i].ou   = profiles[i].name ;
+            n_profiles++;
+        }
+        p = &profiles[i] ;
+        if (!seen[i]) {
+            /* First line for this profile in the file: start afresh */
+            seen[i] = 1 ;
+            p->n = 0 ;
+            sk_X509_EXTENSION_pop_free(p->exts[0], X509_EXTENSION_free);
+            sk_X509_EXTENSION_pop_free(p->exts[1], X509_EXTENSION_free);
+            p->exts[0] = p->exts[1] = NULL ;
+        }
+        if (!strcmp(words[1], "OU")) {
+            p->ou = strdup(words[2]);
+            continue ;
+        }
+        nid = OBJ_txt2nid(words[1]);
+        if (nid==NID_undef || !X509V3_EXT_get_nid(nid) ||
+            nid==NID_subject_alt_name || nid==NID_subject_key_identifier ||
+            nid==NID_authority_key_identifier) {
+            fprintf(stderr, "%s:%d: unsupported extension [%s]\n", filename, lineno, words[1]);
+            ret = -1 ;
+        } else if ((ext=X509V3_EXT_conf_nid(NULL, NULL, nid, words[2]))==NULL) {
+            fprintf(stderr, "%s:%d: bad value for %s: [%s]\n", filename, lineno,
+                    words[1], words[2]);
+            ret = -1 ;
+        } else if (p->n>=MAX_PROFILE_EXT) {
+            X509_EXTENSION_free(ext);
+            fprintf(stderr, "%s:%d: too many extensions\n", filename, lineno);
+            ret = -1 ;
+        } else {
+            X509_EXTENSION_free(ext);
+            p->conf[p->n].nid   = nid ;
+            p->conf[p->n].keys  = KEYS_ANY ;
+            p->conf[p->n].value = strdup(words[2]);
+            p->n++;
+        }
+    }
+    fclose(f);
+    return ret ;
+}
+
+/*
+ * Older libcrypto versions look up digests and ciphers by name or OID in
+ * tables that are empty until filled. They are only filled by the
+ * commands that need them, so that commands such as crl, list or status
+ * start without registering every algorithm. Signing gets its digest
+ * directly from sign_md() and needs nothing. Newer versions load
+ * everything on demand by themselves.
+ */
+#define ALGS_DIGESTS    1   /* verifying signatures, OCSP certificate IDs */
+#define ALGS_CIPHERS    2   /* PKCS#12 key encryption */
+
+static void need_algorithms(int what)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
+    static int loaded=0 ;
+
+    if ((what & ALGS_DIGESTS) && !(loaded & ALGS_DIGESTS))
+        OpenSSL_add_all_digests();
+    if ((what & ALGS_CIPHERS) && !(loaded & ALGS_CIPHERS))
+        OpenSSL_add_all_ciphers();
+    loaded |= what ;
+#endif
+}
+
+/*
+ * CA keys can be kept in a token and used through an engine (libp11 by
+ * default). ca=pkcs11:...;object=NAME uses the key labelled NAME in the
+ * token, while NAME.crt and NAME.crl stay on disk as usual. NAME.key may
+ * also hold such a URI on its first line instead of a PEM key. The
+ * token PIN is read from the CCA_PIN environment variable.
+ */
+#define KEY_URI         "pkcs11:"
+#define MAX_KEY_URIS    16
+
+static struct {
+    char name[FIELD_SZ+1];
+    char uri[FIELD_SZ+1];
+} key_uris[MAX_KEY_URIS] ;
+static int n_key_uris = 0 ;
+
+#ifndef OPENSSL_NO_ENGINE
+static ENGINE * hsm = NULL ;
+#endif
+
+/*
+ * Remember a key URI and return in name the CA name it stands for,
+ * taken from the object attribute. Returns 0 on success.
+ */
+static int key_uri_add(char * uri, char * name)
+{
+    char * p ;
+    int i, n=0 ;
+
+    if ((p=strstr(uri, "object="))==NULL) {
+        fprintf(stderr, "Key URI has no object=: [%s]\n", uri);
+        return -1 ;
+    }
+    /* Percent-decode the label up to the next attribute */
+    for (p+=7 ; *p && *p!=';' && *p!='?' && n<FIELD_SZ ; p++) {
+        if (p[0]=='%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+            sscanf(p+1, "%2x", &i);
+            name[n++] = (char)i ;
+            p += 2 ;
+        } else {
+            name[n++] = *p ;
+        }
+    }
+    name[n] = 0 ;
+    if (n==0 || strchr(name, '/') || name[0]=='.') {
+        fprintf(stderr, "Unusable object name in key URI: [%s]\n", uri);
+        return -1 ;
+    }
+    for (i=0 ; i<n_key_uris && strcmp(key_uris[i].name, name) ; i++)
+        ;
+    if (i==n_key_uris) {
+        if (n_key_uris>=MAX_KEY_URIS) {
+            fprintf(stderr, "Too many key URIs\n");
+            return -1 ;
+        }
+        n_key_uris++;
+    }
+    strcpy(key_uris[i].name, name);
+    strcpy(key_uris[i].uri, uri);
+    return 0 ;
+}
+
+/*
+ * URI of the key for a CA, if it is kept in a token. Returns 1 if so.
+ */
+static int ca_key_uri(char * ca_name, char * uri)
+{
+    char filename[PATH_SZ];
+    char line[FIELD_SZ+2];
+    FILE * f ;
+    int i ;
+
+    for (i=0 ; i<n_key_uris ; i++) {
+        if (!strcmp(key_uris[i].name, ca_name)) {
+            strcpy(uri, key_uris[i].uri);
+            return 1 ;
+        }
+    }
+    if ((f=fopen(ca_file(ca_name, ".key", filename), "r"))==NULL)
+        return 0 ;
+    i = fgets(line, sizeof(line), f)!=NULL && !strncmp(line, KEY_URI, strlen(KEY_URI)) ;
+    fclose(f);
+    if (!i)
+        return 0 ;
+    line[strcspn(line, "\r\n")] = 0 ;
+    strcpy(uri, line);
+    return 1 ;
+}
+
+/*
+ * Key handle from the engine. The engine is loaded and logged in once
+ * per process; every handle gets its own token session.
+ */
+static EVP_PKEY * engine_key(char * uri)
+{
+#ifndef OPENSSL_NO_ENGINE
+    EVP_PKEY * key ;
+    char * pin ;
+
+    if (!hsm) {
+        /* Engines may look algorithms up by name */
+        need_algorithms(ALGS_DIGESTS|ALGS_CIPHERS);
+        ENGINE_load_builtin_engines();
+        if ((hsm=ENGINE_by_id(engine_id))==NULL) {
+            fprintf(stderr, "Cannot load engine %s\n", engine_id);
+            return NULL ;
+        }
+        if (!ENGINE_init(hsm)) {
+            fprintf(stderr, "Cannot initialize engine %s\n", engine_id);
+            ENGINE_free(hsm);
+            hsm = NULL ;
+            return NULL ;
+        }
+        if ((pin=getenv("CCA_PIN"))!=NULL && pin[0])
+            ENGINE_ctrl_cmd_string(hsm, "PIN", pin, 0);
+    }
+    if ((key=ENGINE_load_private_key(hsm, uri, NULL, NULL))==NULL)
+        fprintf(stderr, "Cannot load key %s\n", uri);
+    return key ;
+#else
+    fprintf(stderr, "This OpenSSL has no engine support for %s\n", uri);
+    return NULL ;
+#endif
+}
+
+static void engine_release(void)
+{
+#ifndef OPENSSL_NO_ENGINE
+    if (hsm) {
+        ENGINE_finish(hsm);
+        ENGINE_free(hsm);
+        hsm = NULL ;
+    }
+#endif
+}
+
+/*
+ * Parsed CA files are cached in NAME.cache, as DER: the CA key (unless it
+ * is kept in a token), then the CA certificate and the certificates above
+ * it up to the root. The cache also records the inode, size and mtime of
+ * every file it was built from, and is only used while they are all
+ * unchanged. Runs then skip PEM decoding, the key/certificate match and
+ * the chain lookup. The cache holds the key, it is readable by its owner
+ * only like NAME.key.
+ */
+#define CACHE_MAGIC     "2CCAC001"      /* format version */
+#define CACHE_FILES     10      /* CA files, key file and parents */
+#define CHAIN_DEPTH     8
+
+typedef struct _file_stamp_ {
+    char path[PATH_SZ];
+    unsigned long long ino ;
+    unsigned long long size ;
+    unsigned long long mtime ;
+} file_stamp ;
+
+/* Chains of the CAs loaded in this run */
+static struct {
+    char name[FIELD_SZ+1];
+    STACK_OF(X509) * chain ;
+} ca_chains[CHAIN_DEPTH*2] ;
+static int n_ca_chains = 0 ;
+
+static int stamp_file(char * path, file_stamp * fs)
+{
+    struct stat st ;
+
+    if (stat(path, &st)!=0)
+        return -1 ;
+    snprintf(fs->path, sizeof(fs->path), "%s", path);
+    fs->ino   = st.st_ino ;
+    fs->size  = st.st_size ;
+#ifdef __linux__
+    fs->mtime = st.st_mtim.tv_sec*1000000000ULL + st.st_mtim.tv_nsec ;
+#else
+    fs->mtime = st.st_mtime ;
+#endif
+    return 0 ;
+}
+
+/*
+ * Keep the chain of a CA for the rest of the run, replacing a former one
+ */
+static void ca_chain_keep(char * ca_name, STACK_OF(X509) * chain)
+{
+    int i ;
+
+    for (i=0 ; i<n_ca_chains && strcmp(ca_chains[i].name, ca_name) ; i++)
+        ;
+    if (i==n_ca_chains) {
+        if (n_ca_chains>=(int)(sizeof(ca_chains)/sizeof(ca_chains[0]))) {
+            sk_X509_pop_free(chain, X509_free);
+            return ;
+        }
+        n_ca_chains++;
+    } else {
+        sk_X509_pop_free(ca_chains[i].chain, X509_free);
+    }
+    strcpy(ca_chains[i].name, ca_name);
+    ca_chains[i].chain = chain ;
+}
+
+/*
+ * Certificates from a CA up to its root, following issuer CNs to the
+ * CA files. Stops quietly at the first missing parent. The files read
+ * are added to stamps when given.
+ */
+static STACK_OF(X509) * build_chain(X509 * ca_cert, file_stamp * stamps, int * n_stamps)
+{
+    STACK_OF(X509) * chain ;
+    X509 * cert ;
+    FILE * f ;
+    char cn[FIELD_SZ+1];
+    char filename[PATH_SZ];
+    int depth ;
+
+    chain = sk_X509_new_null();
+    cert = X509_dup(ca_cert);
+    for (depth=0 ; cert && depth<CHAIN_DEPTH ; depth++) {
+        sk_X509_push(chain, cert);
+        if (!X509_NAME_cmp(X509_get_subject_name(cert), X509_get_issuer_name(cert)))
+            break ;
+        if (X509_NAME_get_text_by_NID(X509_get_issuer_name(cert), NID_commonName,
+                                      cn, FIELD_SZ)<0)
+            break ;
+        if ((f=fopen(ca_file(cn, ".crt", filename), "r"))==NULL)
+            break ;
+        if (stamps && *n_stamps<CACHE_FILES &&
+            stamp_file(filename, &stamps[*n_stamps])==0)
+            (*n_stamps)++;
+        cert = PEM_read_X509(f, NULL, NULL, NULL);
+        fclose(f);
+    }
+    return chain ;
+}
+
+/*
+ * Chain for a CA loaded in this run, built from its certificate if needed.
+ * The chain belongs to the run and must not be freed.
+ */
+static STACK_OF(X509) * ca_chain(char * ca_name, X509 * ca_cert)
+{
+    int i ;
+
+    for (i=0 ; i<n_ca_chains ; i++) {
+        if (!strcmp(ca_chains[i].name, ca_name))
+            return ca_chains[i].chain ;
+    }
+    ca_chain_keep(ca_name, build_chain(ca_cert, NULL, NULL));
+    return ca_chain(ca_name, ca_cert);
+}
+
+static void ca_chains_free(void)
+{
+    int i ;
+
+    for (i=0 ; i<n_ca_chains ; i++) {
+        sk_X509_pop_free(ca_chains[i].chain, X509_free);
+    }
+    n_ca_chains = 0 ;
+}
+
+static void put_u32(BIO * mem, unsigned long v)
+{
+    unsigned char b[4];
+
+    b[0] = v>>24 ; b[1] = v>>16 ; b[2] = v>>8 ; b[3] = v ;
+    BIO_write(mem, b, 4);
+}
+
+static void put_u64(BIO * mem, unsigned long long v)
+{
+    put_u32(mem, (unsigned long)(v>>32));
+    put_u32(mem, (unsigned long)(v & 0xffffffffUL));
+}
+
+/*
+ * Read a big-endian number of len bytes, -1 past the end
+ */
+static long long get_num(const unsigned char ** p, const unsigned char * end, int len)
+{
+    long long v=0 ;
+
+    if (end-*p<len)
+        return -1 ;
+    while (len--) {
+        v = (v<<8) | *(*p)++ ;
+    }
+    return v ;
+}
+
+static void cache_put(BIO * mem, unsigned char * der, int len)
+{
+    put_u32(mem, len>0 ? len : 0);
+    if (len>0)
+        BIO_write(mem, der, len);
+}
+
+/*
+ * Write NAME.cache, best effort: a failure only means no cache
+ */
+static void ca_cache_store(char * ca_name, identity * ca, STACK_OF(X509) * chain,
+                           file_stamp * stamps, int n_stamps)
+{
+    char filename[PATH_SZ];
+    unsigned char * der ;
+    BIO * mem ;
+    int i, len ;
+
+    mem = BIO_new(BIO_s_mem());
+    BIO_write(mem, CACHE_MAGIC, 8);
+    put_u32(mem, n_stamps);
+    for (i=0 ; i<n_stamps ; i++) {
+        cache_put(mem, (unsigned char*)stamps[i].path, strlen(stamps[i].path));
+        put_u64(mem, stamps[i].ino);
+        put_u64(mem, stamps[i].size);
+        put_u64(mem, stamps[i].mtime);
+    }
+    /* No key for token keys, it is loaded through the engine */
+    der = NULL ;
+    len = ca->key_uri ? 0 : i2d_PrivateKey(ca->key, &der);
+    put_u32(mem, EVP_PKEY_base_id(ca->key));
+    cache_put(mem, der, len);
+    OPENSSL_free(der);
+    put_u32(mem, sk_X509_num(chain));
+    for (i=0 ; i<sk_X509_num(chain) ; i++) {
+        der = NULL ;
+        len = i2d_X509(sk_X509_value(chain, i), &der);
+        cache_put(mem, der, len);
+        OPENSSL_free(der);
+    }
+    ca_file(ca_name, ".cache", filename);
+    write_bio(filename, mem, 0600);
+    BIO_free(mem);
+}
+
+/*
+ * Load a CA from NAME.cache if it is still valid. Returns 0 on success.
+ */
+static int ca_cache_load(char * ca_name, identity * ca, char * uri)
+{
+    char filename[PATH_SZ];
+    char path[PATH_SZ];
+    file_stamp fs ;
+    STACK_OF(X509) * chain ;
+    const unsigned char * p ;
+    const unsigned char * end ;
+    const unsigned char * q ;
+    unsigned long long v[3];
+    struct stat st ;
+    X509 * cert ;
+    void * map ;
+    long long n, len, type ;
+    int fd, i, j, ok=0 ;
+
+    ca_file(ca_name, ".cache", filename);
+    if ((fd=open(filename, O_RDONLY))<0)
+        return -1 ;
+    if (fstat(fd, &st)!=0 || st.st_size<12) {
+        close(fd);
+        return -1 ;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map==MAP_FAILED)
+        return -1 ;
+    p   = map ;
+    end = p + st.st_size ;
+    ca->key  = NULL ;
+    ca->cert = NULL ;
+    chain = NULL ;
+    if (memcmp(p, CACHE_MAGIC, 8))
+        goto done ;
+    p += 8 ;
+
+    /* Every source file must be unchanged */
+    if ((n=get_num(&p, end, 4))<0 || n>CACHE_FILES)
+        goto done ;
+    for (i=0 ; i<n ; i++) {
+        if ((len=get_num(&p, end, 4))<0 || len>=PATH_SZ || end-p<len)
+            goto done ;
+        memcpy(path, p, len);
+        path[len] = 0 ;
+        p += len ;
+        for (j=0 ; j<3 ; j++) {
+            if (end-p<8)
+                goto done ;
+            v[j] = (unsigned long long)get_num(&p, end, 4)<<32 ;
+            v[j] |= (unsigned long long)get_num(&p, end, 4) ;
+        }
+        if (stamp_file(path, &fs)!=0 || fs.ino!=v[0] || fs.size!=v[1] || fs.mtime!=v[2])
+            goto done ;
+    }
+
+    /* Decoding with a known key type is much cheaper than guessing it */
+    if ((type=get_num(&p, end, 4))<0 || (len=get_num(&p, end, 4))<0 || end-p<len)
+        goto done ;
+    if (len>0) {
+        q = p ;
+        ca->key = d2i_PrivateKey(type, NULL, &q, len);
+    } else if (uri) {
+        ca->key = engine_key(uri);
+    }
+    p += len ;
+    if (!ca->key)
+        goto done ;
+
+    if ((n=get_num(&p, end, 4))<1 || n>CHAIN_DEPTH)
+        goto done ;
+    chain = sk_X509_new_null();
+    for (i=0 ; i<n ; i++) {
+        if ((len=get_num(&p, end, 4))<0 || end-p<len)
+            goto done ;
+        q = p ;
+        if ((cert=d2i_X509(NULL, &q, len))==NULL)
+            goto done ;
+        sk_X509_push(chain, cert);
+        p += len ;
+    }
+    ca->cert = X509_dup(sk_X509_value(chain, 0));
+    ok = ca->cert!=NULL ;
+
+done:
+    munmap(map, st.st_size);
+    if (!ok) {
+        EVP_PKEY_free(ca->key);
+        ca->key = NULL ;
+        sk_X509_pop_free(chain, X509_free);
+        return -1 ;
+    }
+    ca_chain_keep(ca_name, chain);
+    return 0 ;
+}
+
+/*
+ * Load CA certificate and private key from current dir, or the key from
+ * a token. A valid NAME.cache is used first.
+ */
+static int load_ca(char * ca_name, identity * ca)
+{
+    FILE * f ;
+    char filename[PATH_SZ] ;
+    char uri[FIELD_SZ+1] ;
+    file_stamp stamps[CACHE_FILES] ;
+    STACK_OF(X509) * chain ;
+    int n_stamps=0 ;
+    int token ;
+    double t0=now_usec() ;
+
+    token = ca_key_uri(ca_name, uri) ;
+    if (ca_cache_load(ca_name, ca, token ? uri : NULL)==0) {
+        ca->key_uri = token ;
+        stats_stage("ca_cache", t0, 0);
+        return 0 ;
+    }
+
+    ca_file(ca_name, ".crt", filename);
+    if ((f=fopen(filename, "r"))==NULL) {
+        fprintf(stderr, "Cannot find: %s\n", filename);
+        return -1 ; 
+    }
+    stamp_file(filename, &stamps[n_stamps++]);
+    ca->cert = PEM_read_X509(f, NULL, NULL, NULL);
+    fclose(f);
+
+    ca_file(ca_name, ".key", filename);
+    if (stamp_file(filename, &stamps[n_stamps])==0)
+        n_stamps++;
+    ca->key_uri = token ;
+    if (token) {
+        ca->key = engine_key(uri);
+    } else {
+        if ((f=fopen(filename, "r"))==NULL) {
+            return -1 ; 
+        }
+        /* RSA, EC or Ed25519 */
+        ca->key = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+        fclose(f);
+    }
+
+    if (!ca->cert || !ca->key || !X509_check_private_key(ca->cert, ca->key)) {
+        fprintf(stderr, "CA certificate and private key do not match\n");
+        return -1 ;
+    }
+    stats_stage("ca_load", t0, 0);
+    t0 = now_usec();
+    chain = build_chain(ca->cert, stamps, &n_stamps);
+    ca_cache_store(ca_name, ca, chain, stamps, n_stamps);
+    ca_chain_keep(ca_name, chain);
+    stats_stage("ca_cache_write", t0, 0);
+    return 0;
+}
+
+/*
+ * Digest used to sign with a CA key: Ed25519 signs the message itself
+ */
+static const EVP_MD * sign_md(EVP_PKEY * key)
+{
+#ifdef NID_ED25519
+    if (EVP_PKEY_base_id(key)==NID_ED25519)
+        return NULL ;
+#endif
+    return EVP_sha256();
+}
+
+/*
+ * Curve names are accepted either as OpenSSL (prime256v1, secp384r1)
+ * or NIST (P-256, P-384) names
+ */
+static int curve_nid(char * ec_name)
+{
+    int nid ;
+
+    if ((nid=OBJ_txt2nid(ec_name))==NID_undef)
+        nid = EC_curve_nist2nid(ec_name);
+    return nid ;
+}
+
+/*
+ * Generate a key pair: EC if a curve name is given, RSA otherwise.
+ * ec=ed25519 generates an Ed25519 key.
+ */
+static EVP_PKEY * generate_key(int rsa_keysz, char * ec_name, int verbose)
+{
+    EVP_PKEY * pkey ;
+    RSA * rsa ;
+    EC_KEY * ecc ;
+
+#ifdef NID_ED25519
+    EVP_PKEY_CTX * ctx ;
+
+    if (ec_name && !strcasecmp(ec_name, "ed25519")) {
+        if (verbose)
+            printf("Generating Ed25519 key\n");
+        pkey = NULL ;
+        ctx = EVP_PKEY_CTX_new_id(NID_ED25519, NULL);
+        if (!ctx || EVP_PKEY_keygen_init(ctx)<=0 || EVP_PKEY_keygen(ctx, &pkey)<=0) {
+            fprintf(stderr, "Cannot generate Ed25519 key\n");
+            pkey = NULL ;
+        }
+        EVP_PKEY_CTX_free(ctx);
+        return pkey ;
+    }
+#endif
+    if (ec_name && ec_name[0]) {
+        if (verbose)
+            printf("Generating EC key [%s]\n", ec_name);
+        ecc = EC_KEY_new_by_curve_name(curve_nid(ec_name));
+        if (!ecc) {
+            fprintf(stderr, "Unknown curve: [%s]\n", ec_name);
+            return NULL ;
+        }
+        EC_KEY_set_asn1_flag(ecc, OPENSSL_EC_NAMED_CURVE);
+        EC_KEY_generate_key(ecc);
+        pkey = EVP_PKEY_new();
+        EVP_PKEY_assign_EC_KEY(pkey, ecc);
+    } else {
+        if (verbose)
+            printf("Generating RSA-%d key\n", rsa_keysz);
+        rsa = RSA_generate_key(rsa_keysz, RSA_F4, verbose ? progress : NULL, 0);
+        if (!rsa) {
+            fprintf(stderr, "Cannot generate RSA-%d key\n", rsa_keysz);
+            return NULL ;
+        }
+        pkey = EVP_PKEY_new();
+        EVP_PKEY_assign_RSA(pkey, rsa);
+    }
+    return pkey ;
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
+/*
+ * Older libcrypto versions need locking callbacks to be used from threads
+ */
+static pthread_mutex_t * ssl_locks = NULL ;
+
+static void ssl_lock(int mode, int n, const char * file, int line)
+{
+    if (mode & CRYPTO_LOCK) {
+        pthread_mutex_lock(&ssl_locks[n]);
+    } else {
+        pthread_mutex_unlock(&ssl_locks[n]);
+    }
+}
+
+static unsigned long ssl_thread_id(void)
+{
+    return (unsigned long)pthread_self();
+}
+
+static void init_ssl_locks(void)
+{
+    int i ;
+
+    if (ssl_locks)
+        return ;
+    ssl_locks = malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+    for (i=0 ; i<CRYPTO_num_locks() ; i++) {
+        pthread_mutex_init(&ssl_locks[i], NULL);
+    }
+    CRYPTO_set_id_callback(ssl_thread_id);
+    CRYPTO_set_locking_callback(ssl_lock);
+}
+#else
+static void init_ssl_locks(void) {}
+#endif
+
+/*
+ * Key generation worker pool: threads pick up the next pending job
+ * until all are done. Only key generation runs in parallel, signing and
+ * writing files stay on the calling thread.
+ */
+typedef struct _keyjob_ {
+    int  rsa_keysz ;
+    char ec_name[FIELD_SZ+1] ;
+    EVP_PKEY * key ;
+} keyjob ;
+
+static struct {
+    pthread_mutex_t lock ;
+    keyjob * jobs ;
+    int      n ;
+    int      next ;
+} keypool_work = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 } ;
+
+static void * keygen_worker(void * arg)
+{
+    int i ;
+
+    while (1) {
+        pthread_mutex_lock(&keypool_work.lock);
+        i = keypool_work.next++ ;
+        pthread_mutex_unlock(&keypool_work.lock);
+        if (i>=keypool_work.n)
+            break ;
+        if (keypool_work.jobs[i].key)
+            continue ;
+        if (keypool_work.jobs[i].rsa_keysz<=0 && !keypool_work.jobs[i].ec_name[0])
+            continue ;
+        keypool_work.jobs[i].key = generate_key(keypool_work.jobs[i].rsa_keysz,
+                                                keypool_work.jobs[i].ec_name,
+                                                0);
+    }
+    return NULL ;
+}
+
+/*
+ * Generate keys for all jobs using up to n_threads threads
+ */
+static void generate_keys(keyjob * jobs, int n, int n_threads)
+{
+    pthread_t * tids ;
+    int i, started ;
+
+    keypool_work.jobs = jobs ;
+    keypool_work.n    = n ;
+    keypool_work.next = 0 ;
+
+    if (n_threads>n)
+        n_threads=n ;
+    if (n_threads<=1) {
+        keygen_worker(NULL);
+        return ;
+    }
+    init_ssl_locks();
+    tids = malloc(n_threads * sizeof(pthread_t));
+    for (started=0 ; started<n_threads ; started++) {
+        if (pthread_create(&tids[started], NULL, keygen_worker, NULL)!=0)
+            break ;
+    }
+    if (started==0) {
+        /* No thread could be started: do it ourselves */
+        keygen_worker(NULL);
+    }
+    for (i=0 ; i<started ; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+}
+
+/*
+ * Pre-generated keys are stored as individual PEM files in one directory
+ * per key type, e.g. keypool/rsa-4096/ or keypool/ec-prime256v1/
+ */
+static void keypool_path(int rsa_keysz, char * ec_name, char * path)
+{
+    if (ec_name && ec_name[0]) {
+        sprintf(path, "%s/ec-%s", keypool_dir, ec_name);
+    } else {
+        sprintf(path, "%s/rsa-%d", keypool_dir, rsa_keysz);
+    }
+}
+
+static int keypool_is_key(char * filename)
+{
+    size_t len = strlen(filename);
+    return filename[0]!='.' && len>4 && !strcmp(filename+len-4, ".key");
+}
+
+/*
+ * Take one key out of the pool, NULL if none is available.
+ * Keys are claimed by renaming them first so that concurrent
+ * invocations never get the same key.
+ */
+static EVP_PKEY * keypool_take(int rsa_keysz, char * ec_name)
+{
+    DIR * dir ;
+    struct dirent * de ;
+    char path[2*FIELD_SZ+1];
+    char src[4*FIELD_SZ+1];
+    char dst[4*FIELD_SZ+1];
+    EVP_PKEY * pkey=NULL ;
+    FILE * f ;
+
+    keypool_path(rsa_keysz, ec_name, path);
+    if ((dir=opendir(path))==NULL)
+        return NULL ;
+
+    sprintf(dst, "%s/.taken-%ld", path, (long)getpid());
+    while (!pkey && (de=readdir(dir))!=NULL) {
+        if (!keypool_is_key(de->d_name))
+            continue ;
+        sprintf(src, "%s/%s", path, de->d_name);
+        if (rename(src, dst)!=0) {
+            /* Somebody else got it first */
+            continue ;
+        }
+        if ((f=fopen(dst, "r"))!=NULL) {
+            pkey = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+            fclose(f);
+        }
+        unlink(dst);
+    }
+    closedir(dir);
+    return pkey ;
+}
+
+/*
+ * Count keys currently available in the pool
+ */
+static int keypool_count(int rsa_keysz, char * ec_name)
+{
+    DIR * dir ;
+    struct dirent * de ;
+    char path[2*FIELD_SZ+1];
+    int n=0 ;
+
+    keypool_path(rsa_keysz, ec_name, path);
+    if ((dir=opendir(path))==NULL)
+        return 0 ;
+    while ((de=readdir(dir))!=NULL) {
+        if (keypool_is_key(de->d_name))
+            n++;
+    }
+    closedir(dir);
+    return n ;
+}
+
+/*
+ * Top up the pool to count keys of the given type
+ */
+static int keypool_fill(int rsa_keysz, char * ec_name, int count)
+{
+    keyjob * kjobs ;
+    char path[2*FIELD_SZ+1];
+    char filename[4*FIELD_SZ+1];
+    int i, n, made=0 ;
+    BIO * mem ;
+
+    keypool_path(rsa_keysz, ec_name, path);
+    if ((mkdir(keypool_dir, 0700)!=0 && access(keypool_dir, W_OK)!=0) ||
+        (mkdir(path, 0700)!=0 && access(path, W_OK)!=0)) {
+        fprintf(stderr, "Cannot create key pool: %s\n", path);
+        return -1 ;
+    }
+
+    n = count - keypool_count(rsa_keysz, ec_name);
+    if (n<=0) {
+        printf("Key pool %s already holds %d keys\n", path, count);
+        return 0 ;
+    }
+    printf("Generating %d keys into %s\n", n, path);
+    kjobs = calloc(n, sizeof(keyjob));
+    for (i=0 ; i<n ; i++) {
+        kjobs[i].rsa_keysz = rsa_keysz ;
+        if (ec_name)
+            strcpy(kjobs[i].ec_name, ec_name);
+    }
+    generate_keys(kjobs, n, n_jobs);
+
+    write_group_begin();
+    for (i=0 ; i<n ; i++) {
+        if (!kjobs[i].key)
+            continue ;
+        sprintf(filename, "%s/%ld-%ld-%d.key", path, (long)time(NULL), (long)getpid(), i);
+        mem = BIO_new(BIO_s_mem());
+        PEM_write_bio_PrivateKey(mem, kjobs[i].key, NULL, NULL, 0, NULL, NULL);
+        if (write_bio(filename, mem, 0600)>=0)
+            made++;
+        BIO_free(mem);
+        EVP_PKEY_free(kjobs[i].key);
+    }
+    write_group_end();
+    free(kjobs);
+    printf("Key pool %s now holds %d keys\n", path, keypool_count(rsa_keysz, ec_name));
+    return made==n ? 0 : -1 ;
+}
+
+/*
+ * CA identities stay loaded for the whole run in batch mode
+ */
+#define MAX_CA      16
+#define MAX_SIGNERS 16      /* signing threads, each with its own key handle */
+
+static struct {
+    char     name[FIELD_SZ+1];
+    identity id ;
+    char     uri[FIELD_SZ+1];           /* key URI for token keys */
+    EVP_PKEY * signers[MAX_SIGNERS] ;   /* extra handles, opened on demand */
+} ca_cache[MAX_CA] ;
+static int ca_cached=0 ;
+
+/*
+ * Find a signing CA in the cache, load it on first use
+ */
+static identity * get_ca(char * ca_name)
+{
+    int i ;
+
+    for (i=0 ; i<ca_cached ; i++) {
+        if (!strcmp(ca_cache[i].name, ca_name)) {
+            return &ca_cache[i].id ;
+        }
+    }
+    if (ca_cached>=MAX_CA) {
+        fprintf(stderr, "Too many signing CAs in one run\n");
+        return NULL ;
+    }
+    if (load_ca(ca_name, &ca_cache[ca_cached].id)!=0) {
+        return NULL ;
+    }
+    strcpy(ca_cache[ca_cached].name, ca_name);
+    if (!ca_key_uri(ca_name, ca_cache[ca_cached].uri))
+        ca_cache[ca_cached].uri[0] = 0 ;
+    memset(ca_cache[ca_cached].signers, 0, sizeof(ca_cache[ca_cached].signers));
+    return &ca_cache[ca_cached++].id ;
+}
+
+/*
+ * Key to sign with from thread slot for a cached CA. Token keys get one
+ * handle, hence one session, per slot so that signatures proceed in
+ * parallel on the token. Other keys are shared.
+ */
+static EVP_PKEY * ca_signer(identity * ca, int slot)
+{
+    int i ;
+
+    for (i=0 ; i<ca_cached && &ca_cache[i].id!=ca ; i++)
+        ;
+    if (i==ca_cached || slot<=0 || slot>=MAX_SIGNERS || !ca_cache[i].uri[0])
+        return ca->key ;
+    if (!ca_cache[i].signers[slot])
+        ca_cache[i].signers[slot] = engine_key(ca_cache[i].uri);
+    return ca_cache[i].signers[slot] ? ca_cache[i].signers[slot] : ca->key ;
+}
+
+static void free_ca_cache(void)
+{
+    int i, j ;
+
+    for (i=0 ; i<ca_cached ; i++) {
+        X509_free(ca_cache[i].id.cert);
+        EVP_PKEY_free(ca_cache[i].id.key);
+        for (j=0 ; j<MAX_SIGNERS ; j++) {
+            EVP_PKEY_free(ca_cache[i].signers[j]);
+        }
+    }
+    ca_cached=0 ;
+    ca_chains_free();
+    engine_release();
+}
+
+/*
+ * Index of issued certificates
+ * Every issuance and revocation appends one line to the index file:
+ *   status  notAfter  revocationDate  serial  issuer  CN  [leaf]
+ * separated by tabs, with status V (valid) or R (revoked), dates as
+ * GeneralizedTime and the serial in hex. Issuance records also carry the
+ * number of the certificate in the issuance log. The file is never rewritten:
+ * the last line seen for a serial gives its current status.
+ * Lookups load the index once into hash tables keyed by CN and serial.
+ */
+#define INDEX_FILE  "2cca.idx"
+
+static char * index_file(void)
+{
+    static char path[PATH_SZ];
+
+    if (store_dir[0]) {
+        snprintf(path, sizeof(path), "%s/%s", store_dir, INDEX_FILE);
+        return path ;
+    }
+    return INDEX_FILE ;
+}
+#define TIME_SZ     15      /* YYYYMMDDHHMMSSZ */
+#define SERIAL_HEX  (2*SERIAL_SZ)
+
+typedef struct _idx_entry_ {
+    char status ;
+    char not_after[TIME_SZ+1] ;
+    char revoked[TIME_SZ+1] ;
+    char serial[SERIAL_HEX+1] ;
+    char issuer[FIELD_SZ+1] ;
+    char cn[FIELD_SZ+1] ;
+    long offset ;           /* of the latest record in the index file */
+    long leaf ;             /* number in the issuance log, -1 if none */
+    int  next_cn ;
+    int  next_serial ;
+} idx_entry ;
+
+static struct {
+    idx_entry * entries ;
+    int  n ;
+    int  sz ;
+    int * by_cn ;
+    int * by_serial ;
+    int  buckets ;
+    int  loaded ;
+    long end ;      /* of the last complete record read */
+} cert_index ;
+
+static unsigned int index_hash(char * s)
+{
+    unsigned int h=2166136261u ;
+
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u ;
+    }
+    return h ;
+}
+
+static idx_entry * index_find_serial(char * serial)
+{
+    int i ;
+
+    if (!cert_index.buckets)
+        return NULL ;
+    i = cert_index.by_serial[index_hash(serial) % cert_index.buckets];
+    for ( ; i>=0 ; i=cert_index.entries[i].next_serial) {
+        if (!strcmp(cert_index.entries[i].serial, serial))
+            return &cert_index.entries[i] ;
+    }
+    return NULL ;
+}
+
+/*
+ * Most recent certificate issued under a given CN
+ */
+static idx_entry * index_find_cn(char * cn)
+{
+    int i ;
+
+    if (!cert_index.buckets)
+        return NULL ;
+    i = cert_index.by_cn[index_hash(cn) % cert_index.buckets];
+    for ( ; i>=0 ; i=cert_index.entries[i].next_cn) {
+        if (!strcmp(cert_index.entries[i].cn, cn))
+            return &cert_index.entries[i] ;
+    }
+    return NULL ;
+}
+
+/*
+ * Most recent certificate issued under a given CN by a given CA
+ */
+static idx_entry * index_find_issued(char * issuer, char * cn)
+{
+    int i ;
+
+    if (!cert_index.buckets)
+        return NULL ;
+    i = cert_index.by_cn[index_hash(cn) % cert_index.buckets];
+    for ( ; i>=0 ; i=cert_index.entries[i].next_cn) {
+        if (!strcmp(cert_index.entries[i].cn, cn) &&
+            !strcmp(cert_index.entries[i].issuer, issuer))
+            return &cert_index.entries[i] ;
+    }
+    return NULL ;
+}
+
+static void index_rehash(int buckets)
+{
+    unsigned int h ;
+    int i ;
+
+    free(cert_index.by_cn);
+    free(cert_index.by_serial);
+    cert_index.buckets   = buckets ;
+    cert_index.by_cn     = malloc(buckets * sizeof(int));
+    cert_index.by_serial = malloc(buckets * sizeof(int));
+    memset(cert_index.by_cn,     0xff, buckets * sizeof(int));
+    memset(cert_index.by_serial, 0xff, buckets * sizeof(int));
+    /* Insert in order so that newer entries come first in chains */
+    for (i=0 ; i<cert_index.n ; i++) {
+        h = index_hash(cert_index.entries[i].cn) % buckets ;
+        cert_index.entries[i].next_cn = cert_index.by_cn[h] ;
+        cert_index.by_cn[h] = i ;
+        h = index_hash(cert_index.entries[i].serial) % buckets ;
+        cert_index.entries[i].next_serial = cert_index.by_serial[h] ;
+        cert_index.by_serial[h] = i ;
+    }
+}
+
+/*
+ * Account for one index record in memory
+ */
+static void index_insert(idx_entry * rec)
+{
+    idx_entry * e ;
+    unsigned int h ;
+
+    if ((e=index_find_serial(rec->serial))!=NULL) {
+        /* Status change for a known certificate */
+        e->status = rec->status ;
+        strcpy(e->revoked, rec->revoked);
+        e->offset = rec->offset ;
+        return ;
+    }
+    if (cert_index.n>=cert_index.sz) {
+        cert_index.sz = cert_index.sz ? 2*cert_index.sz : 1024 ;
+        cert_index.entries = realloc(cert_index.entries,
+                                     cert_index.sz * sizeof(idx_entry));
+    }
+    if (cert_index.n>=cert_index.buckets) {
+        index_rehash(cert_index.sz*2);
+    }
+    e = &cert_index.entries[cert_index.n] ;
+    *e = *rec ;
+    h = index_hash(e->cn) % cert_index.buckets ;
+    e->next_cn = cert_index.by_cn[h] ;
+    cert_index.by_cn[h] = cert_index.n ;
+    h = index_hash(e->serial) % cert_index.buckets ;
+    e->next_serial = cert_index.by_serial[h] ;
+    cert_index.by_serial[h] = cert_index.n ;
+    cert_index.n++;
+}
+
+/*
+ * Parse one tab-separated index line. Returns 0 on success.
+ */
+static int index_parse(char * line, idx_entry * rec)
+{
+    char * fields[7];
+    char * p = line ;
+    char sep ;
+    int n ;
+
+    /* The leaf number is missing from older records */
+    for (n=0 ; n<7 ; ) {
+        fields[n++] = p ;
+        while (*p && *p!='\t' && *p!='\n')
+            p++;
+        sep = *p ;
+        *p = 0 ;
+        if (sep!='\t')
+            break ;
+        p++;
+    }
+    if (n<6)
+        return -1 ;
+    if (strlen(fields[1])>TIME_SZ || strlen(fields[2])>TIME_SZ ||
+        strlen(fields[3])>SERIAL_HEX || strlen(fields[4])>FIELD_SZ ||
+        strlen(fields[5])>FIELD_SZ)
+        return -1 ;
+    rec->status = fields[0][0] ;
+    strcpy(rec->not_after, fields[1]);
+    strcpy(rec->revoked,   fields[2]);
+    strcpy(rec->serial,    fields[3]);
+    strcpy(rec->issuer,    fields[4]);
+    strcpy(rec->cn,        fields[5]);
+    rec->leaf = n>6 && isdigit((unsigned char)fields[6][0]) ? atol(fields[6]) : -1 ;
+    return 0 ;
+}
+
+/*
+ * Read the records appended to the index since it was last read, for
+ * processes that keep it loaded. A line still being written is left
+ * for the next call. Returns the number of certificates known.
+ */
+static int index_update(void)
+{
+    FILE * f ;
+    char line[BATCH_LINE];
+    idx_entry rec ;
+    long offset ;
+
+    cert_index.loaded = 1 ;
+    if ((f=fopen(index_file(), "r"))==NULL)
+        return cert_index.n ;
+    offset = cert_index.end ;
+    fseek(f, offset, SEEK_SET);
+    while (fgets(line, BATCH_LINE, f) && strchr(line, '\n')) {
+        if (index_parse(line, &rec)==0) {
+            rec.offset = offset ;
+            index_insert(&rec);
+        }
+        offset = ftell(f);
+    }
+    cert_index.end = offset ;
+    fclose(f);
+    return cert_index.n ;
+}
+
+/*
+ * Read the whole index once. Returns the number of certificates known.
+ */
+static int index_load(void)
+{
+    if (cert_index.loaded)
+        return cert_index.n ;
+    return index_update();
+}
+
+static void index_free(void)
+{
+    free(cert_index.entries);
+    free(cert_index.by_cn);
+    free(cert_index.by_serial);
+    memset(&cert_index, 0, sizeof(cert_index));
+}
+
+static void asn1_time_str(ASN1_TIME * tm, char * out)
+{
+    ASN1_GENERALIZEDTIME * gt ;
+
+    out[0] = 0 ;
+    if ((gt=ASN1_TIME_to_generalizedtime(tm, NULL))!=NULL) {
+        if (gt->length<=TIME_SZ) {
+            memcpy(out, gt->data, gt->length);
+            out[gt->length] = 0 ;
+        }
+        ASN1_GENERALIZEDTIME_free(gt);
+    }
+}
+
+static void serial_str(ASN1_INTEGER * serial, char * out)
+{
+    BIGNUM * bn ;
+    char * hex ;
+
+    out[0] = 0 ;
+    bn = ASN1_INTEGER_to_BN(serial, NULL);
+    if ((hex=BN_bn2hex(bn))!=NULL) {
+        if (strlen(hex)<=SERIAL_HEX)
+            strcpy(out, hex);
+        OPENSSL_free(hex);
+    }
+    BN_free(bn);
+}
+
+/*
+ * Fill an index record for a certificate
+ */
+static void index_record(char status, X509 * cert, ASN1_TIME * revoked,
+                         char * issuer, char * cn, idx_entry * rec)
+{
+    memset(rec, 0, sizeof(idx_entry));
+    rec->status = status ;
+    asn1_time_str(X509_get_notAfter(cert), rec->not_after);
+    if (revoked)
+        asn1_time_str(revoked, rec->revoked);
+    serial_str(X509_get_serialNumber(cert), rec->serial);
+    snprintf(rec->issuer, FIELD_SZ+1, "%s", issuer);
+    snprintf(rec->cn,     FIELD_SZ+1, "%s", cn);
+    rec->leaf = -1 ;
+}
+
+/*
+ * Append one record to the index. Each record goes out in a single
+ * write on a file opened in append mode, so that concurrent invocations
+ * do not interleave lines.
+ */
+static int index_write(idx_entry * rec)
+{
+    char line[BATCH_LINE];
+    char leaf[24] = "" ;
+    int fd, len ;
+
+    if (rec->leaf>=0)
+        snprintf(leaf, sizeof(leaf), "\t%ld", rec->leaf);
+    len = snprintf(line, BATCH_LINE, "%c\t%s\t%s\t%s\t%s\t%s%s\n",
+                   rec->status, rec->not_after, rec->revoked, rec->serial,
+                   rec->issuer, rec->cn, leaf);
+    if ((fd=open(index_file(), O_WRONLY|O_APPEND|O_CREAT, 0644))<0 &&
+        errno==ENOENT && make_parents(index_file())==0) {
+        fd = open(index_file(), O_WRONLY|O_APPEND|O_CREAT, 0644);
+    }
+    if (fd<0) {
+        fprintf(stderr, "Cannot update %s\n", index_file());
+        return -1 ;
+    }
+    rec->offset = lseek(fd, 0, SEEK_END);
+    if (write(fd, line, len)!=len) {
+        fprintf(stderr, "Cannot update %s\n", index_file());
+        close(fd);
+        return -1 ;
+    }
+    close(fd);
+    if (cert_index.loaded)
+        index_insert(rec);
+    return 0 ;
+}
+
+static int index_append(char status, X509 * cert, ASN1_TIME * revoked,
+                        char * issuer, char * cn)
+{
+    idx_entry rec ;
+
+    index_record(status, cert, revoked, issuer, cn, &rec);
+    return index_write(&rec);
+}
+
+static void index_print(idx_entry * e)
+{
+    printf("%c %s %s %s %s %s\n", e->status, e->not_after,
+           e->revoked[0] ? e->revoked : "-", e->serial, e->issuer, e->cn);
+}
+
+/*
+ * List all certificates from the index, without touching any PEM file
+ */
+void list_certs(void)
+{
+    int i ;
+
+    index_load();
+    for (i=0 ; i<cert_index.n ; i++) {
+        index_print(&cert_index.entries[i]);
+    }
+    index_free();
+}
+
+/*
+ * Find a certificate by serial (hex) or by CN. Returns 0 if found.
+ */
+int find_cert(char * serial, char * cn)
+{
+    idx_entry * e ;
+    char * p ;
+
+    /* Serials are recorded in upper case hex */
+    for (p=serial ; p && *p ; p++) {
+        *p = toupper((unsigned char)*p);
+    }
+    index_load();
+    e = serial ? index_find_serial(serial) : index_find_cn(cn) ;
+    if (e) {
+        index_print(e);
+    } else {
+        printf("Not found: %s\n", serial ? serial : cn);
+    }
+    index_free();
+    return e ? 0 : -1 ;
+}
+
+/*
+ * Issuance log
+ * Every certificate issued is a leaf of a Merkle tree built as in
+ * RFC 6962: leaf hash SHA256(0x00 || DER), node hash
+ * SHA256(0x01 || left || right). The log file holds the hashes of all
+ * complete subtrees in post-order, 32 bytes each, so that it only grows
+ * and the node over leaves [j*2^k, (j+1)*2^k) sits at a fixed offset.
+ * While files are written in a group, leaves are queued and appended
+ * together by log_flush(), which adds a single tree head to the heads
+ * file for the whole group:
+ *   treeSize  rootHash  time
+ * The index then records the leaf number of each certificate, so that
+ * an inclusion proof reads O(log^2 n) nodes whatever the size of the log.
+ */
+#define LOG_FILE    "2cca.log"
+#define HEADS_FILE  "2cca.sth"
+#define HASH_SZ     SHA256_DIGEST_LENGTH
+#define HEAD_LINE   (20+1+2*HASH_SZ+1+TIME_SZ+1)
+#define LOG_DEPTH   64     /* levels of the tree */
+
+static struct {
+    idx_entry * recs ;
+    unsigned char (*leaves)[HASH_SZ] ;
+    int  n ;
+    int  sz ;
+} log_queue ;
+
+static char * log_file(char * name, char * path)
+{
+    if (store_dir[0]) {
+        snprintf(path, PATH_SZ, "%s/%s", store_dir, name);
+    } else {
+        snprintf(path, PATH_SZ, "%s", name);
+    }
+    return path ;
+}
+
+static void hash_hex(unsigned char * md, char * hex)
+{
+    int i ;
+
+    for (i=0 ; i<HASH_SZ ; i++) {
+        sprintf(hex+2*i, "%02x", md[i]);
+    }
+}
+
+static void log_leaf(X509 * cert, unsigned char * md)
+{
+    unsigned char prefix=0 ;
+    unsigned char * der=NULL ;
+    SHA256_CTX ctx ;
+    int len ;
+
+    len = i2d_X509(cert, &der);
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &prefix, 1);
+    if (len>0)
+        SHA256_Update(&ctx, der, len);
+    SHA256_Final(md, &ctx);
+    OPENSSL_free(der);
+}
+
+/* out may be one of the children */
+static void log_node(unsigned char * left, unsigned char * right, unsigned char * out)
+{
+    unsigned char prefix=1 ;
+    SHA256_CTX ctx ;
+
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &prefix, 1);
+    SHA256_Update(&ctx, left, HASH_SZ);
+    SHA256_Update(&ctx, right, HASH_SZ);
+    SHA256_Final(out, &ctx);
+}
+
+/* Nodes stored for a tree of n leaves */
+static long log_nodes(long n)
+{
+    long bits=0, m ;
+
+    for (m=n ; m ; m>>=1)
+        bits += m&1 ;
+    return 2*n-bits ;
+}
+
+/* Offset of node j at level k, written right after its last leaf */
+static off_t log_offset(int k, long j)
+{
+    return (off_t)(log_nodes(((j+1)<<k)-1)+k) * HASH_SZ ;
+}
+
+static int log_read(int fd, int k, long j, unsigned char * md)
+{
+    return pread(fd, md, HASH_SZ, log_offset(k, j))==HASH_SZ ? 0 : -1 ;
+}
+
+/*
+ * Write the parents completed by leaf i, from level k up
+ */
+static int log_parents(int fd, long i, int k)
+{
+    unsigned char left[HASH_SZ], right[HASH_SZ];
+    long j ;
+
+    for ( ; k<LOG_DEPTH && ((i+1)&((1L<<k)-1))==0 ; k++) {
+        j = ((i+1)>>k)-1 ;
+        if (log_read(fd, k-1, 2*j, left)!=0 || log_read(fd, k-1, 2*j+1, right)!=0)
+            return -1 ;
+        log_node(left, right, left);
+        if (pwrite(fd, left, HASH_SZ, log_offset(k, j))!=HASH_SZ)
+            return -1 ;
+    }
+    return 0 ;
+}
+
+/*
+ * Number of leaves in the log. The tail of an interrupted update is
+ * completed: a leaf is only written whole, its parents may be missing.
+ */
+static long log_size(int fd)
+{
+    struct stat st ;
+    long nodes, n ;
+
+    if (fstat(fd, &st)!=0)
+        return -1 ;
+    nodes = st.st_size/HASH_SZ ;
+    if (st.st_size%HASH_SZ && ftruncate(fd, (off_t)nodes*HASH_SZ)!=0)
+        return -1 ;
+    for (n=nodes/2 ; log_nodes(n)<nodes ; n++)
+        ;
+    if (log_nodes(n)!=nodes &&
+        log_parents(fd, n-1, nodes-log_nodes(n-1))!=0)
+        return -1 ;
+    return n ;
+}
+
+/* Largest power of two below n */
+static long log_split(long n)
+{
+    long k=1 ;
+
+    while (2*k<n)
+        k *= 2 ;
+    return k ;
+}
+
+/*
+ * Hash of the tree over leaves [lo, lo+n), n>0. Ranges split as in
+ * RFC 6962 always start on a multiple of their size when it is a power
+ * of two, so complete subtrees are read from the log as they are.
+ */
+static int log_tree(int fd, long lo, long n, unsigned char * md)
+{
+    unsigned char right[HASH_SZ];
+    long k ;
+    int level ;
+
+    if ((n&(n-1))==0) {
+        for (level=0 ; (1L<<level)<n ; level++)
+            ;
+        return log_read(fd, level, lo>>level, md);
+    }
+    k = log_split(n);
+    if (log_tree(fd, lo, k, md)!=0 || log_tree(fd, lo+k, n-k, right)!=0)
+        return -1 ;
+    log_node(md, right, md);
+    return 0 ;
+}
+
+/*
+ * Audit path of leaf m in the tree over leaves [lo, lo+n), nearest
+ * sibling first. Returns the number of hashes, -1 on error.
+ */
+static int log_path(int fd, long m, long lo, long n, unsigned char (*path)[HASH_SZ])
+{
+    long k ;
+    int len ;
+
+    if (n<=1)
+        return 0 ;
+    k = log_split(n);
+    if (m<k) {
+        len = log_path(fd, m, lo, k, path);
+        if (len<0 || log_tree(fd, lo+k, n-k, path[len])!=0)
+            return -1 ;
+    } else {
+        len = log_path(fd, m-k, lo+k, n-k, path);
+        if (len<0 || log_tree(fd, lo, k, path[len])!=0)
+            return -1 ;
+    }
+    return len+1 ;
+}
+
+/*
+ * Check an audit path against a root, as a client would (RFC 9162 2.1.3.2)
+ */
+static int log_verify(long m, long n, unsigned char * leaf,
+                      unsigned char (*path)[HASH_SZ], int len, unsigned char * root)
+{
+    unsigned char md[HASH_SZ];
+    long fn=m, sn=n-1 ;
+    int i ;
+
+    memcpy(md, leaf, HASH_SZ);
+    for (i=0 ; i<len ; i++) {
+        if (sn==0)
+            return -1 ;
+        if ((fn&1) || fn==sn) {
+            log_node(path[i], md, md);
+            while (!(fn&1) && fn!=0) {
+                fn >>= 1 ;
+                sn >>= 1 ;
+            }
+        } else {
+            log_node(md, path[i], md);
+        }
+        fn >>= 1 ;
+        sn >>= 1 ;
+    }
+    return sn==0 && !memcmp(md, root, HASH_SZ) ? 0 : -1 ;
+}
+
+/*
+ * Append a tree head. Lines have a fixed length so that the latest one
+ * is read from the end of the file.
+ */
+static int log_head(long n, unsigned char * root)
+{
+    char filename[PATH_SZ];
+    char line[HEAD_LINE+1];
+    char hex[2*HASH_SZ+1];
+    char tm[TIME_SZ+1];
+    time_t now=time(NULL);
+    int fd, len, ok ;
+
+    hash_hex(root, hex);
+    strftime(tm, sizeof(tm), "%Y%m%d%H%M%SZ", gmtime(&now));
+    len = snprintf(line, sizeof(line), "%020ld\t%s\t%s\n", n, hex, tm);
+    if ((fd=open(log_file(HEADS_FILE, filename), O_WRONLY|O_APPEND|O_CREAT, 0644))<0)
+        return -1 ;
+    ok = write(fd, line, len)==len && fsync(fd)==0 ;
+    close(fd);
+    return ok ? 0 : -1 ;
+}
+
+/*
+ * Latest tree head. Returns -1 if there is none.
+ */
+static int log_last_head(long * n, unsigned char * root, char * tm)
+{
+    struct stat st ;
+    char filename[PATH_SZ];
+    char line[HEAD_LINE+1];
+    char hex[2*HASH_SZ+1];
+    int fd, i, ok ;
+
+    if ((fd=open(log_file(HEADS_FILE, filename), O_RDONLY))<0)
+        return -1 ;
+    ok = fstat(fd, &st)==0 && st.st_size>=HEAD_LINE &&
+         pread(fd, line, HEAD_LINE, st.st_size-HEAD_LINE)==HEAD_LINE ;
+    close(fd);
+    if (!ok)
+        return -1 ;
+    line[HEAD_LINE] = 0 ;
+    if (sscanf(line, "%ld\t%64s\t%15s", n, hex, tm)!=3 || strlen(hex)!=2*HASH_SZ)
+        return -1 ;
+    for (i=0 ; i<HASH_SZ ; i++) {
+        if (sscanf(hex+2*i, "%2hhx", &root[i])!=1)
+            return -1 ;
+    }
+    return 0 ;
+}
+
+/*
+ * Append queued leaves to the log under its lock, publish one tree head
+ * for them and write their index records with the leaf numbers.
+ * Records are written even if the log cannot be updated.
+ */
+static int log_flush(void)
+{
+    char filename[PATH_SZ];
+    unsigned char root[HASH_SZ];
+    char tm[TIME_SZ+1];
+    long first=0, n ;
+    int fd, i, added=0, ret=-1 ;
+
+    if (log_queue.n==0)
+        return 0 ;
+    log_file(LOG_FILE, filename);
+    if ((fd=open(filename, O_RDWR|O_CREAT, 0644))<0 &&
+        errno==ENOENT && make_parents(filename)==0) {
+        fd = open(filename, O_RDWR|O_CREAT, 0644);
+    }
+    if (fd>=0 && flock(fd, LOCK_EX)==0 && (first=log_size(fd))>=0) {
+        /* Leaves covered by a published head cannot go missing */
+        if (log_last_head(&n, root, tm)==0 && n>first) {
+            fprintf(stderr, "%s holds fewer leaves than its last tree head\n", filename);
+        } else {
+            for (n=first ; added<log_queue.n ; added++, n++) {
+                if (pwrite(fd, log_queue.leaves[added], HASH_SZ,
+                           log_offset(0, n))!=HASH_SZ ||
+                    log_parents(fd, n, 1)!=0)
+                    break ;
+            }
+            if (added==log_queue.n && fsync(fd)==0 &&
+                log_tree(fd, 0, n, root)==0 && log_head(n, root)==0)
+                ret = 0 ;
+        }
+    }
+    if (ret!=0)
+        fprintf(stderr, "Cannot update %s\n", filename);
+    for (i=0 ; i<log_queue.n ; i++) {
+        log_queue.recs[i].leaf = i<added ? first+i : -1 ;
+        if (index_write(&log_queue.recs[i])!=0)
+            ret = -1 ;
+    }
+    if (fd>=0)
+        close(fd);
+    log_queue.n = 0 ;
+    return ret ;
+}
+
+/*
+ * Record an issued certificate in the log and in the index. Inside a
+ * write group this waits for log_flush().
+ */
+static int log_issue(X509 * cert, char * issuer, char * cn)
+{
+    if (log_queue.n>=log_queue.sz) {
+        log_queue.sz = log_queue.sz ? 2*log_queue.sz : 1024 ;
+        log_queue.recs = realloc(log_queue.recs, log_queue.sz * sizeof(idx_entry));
+        log_queue.leaves = realloc(log_queue.leaves, log_queue.sz * HASH_SZ);
+    }
+    index_record('V', cert, NULL, issuer, cn, &log_queue.recs[log_queue.n]);
+    log_leaf(cert, log_queue.leaves[log_queue.n]);
+    log_queue.n++;
+    return grouping ? 0 : log_flush();
+}
+
+/*
+ * Forget a queued certificate whose files could not be published
+ */
+static void log_drop(char * issuer, char * cn)
+{
+    int i ;
+
+    for (i=0 ; i<log_queue.n ; i++) {
+        if (!strcmp(log_queue.recs[i].issuer, issuer) &&
+            !strcmp(log_queue.recs[i].cn, cn))
+            break ;
+    }
+    if (i==log_queue.n)
+        return ;
+    log_queue.n--;
+    memmove(&log_queue.recs[i], &log_queue.recs[i+1],
+            (log_queue.n-i) * sizeof(idx_entry));
+    memmove(log_queue.leaves[i], log_queue.leaves[i+1], (log_queue.n-i) * HASH_SZ);
+}
+
+/*
+ * Show the inclusion proof of a certificate in the latest tree head and
+ * check it. Without serial or name, show the latest tree head.
+ * Returns 0 if the proof holds.
+ */
+int log_proof(char * serial, char * cn)
+{
+    unsigned char path[LOG_DEPTH][HASH_SZ];
+    unsigned char leaf[HASH_SZ];
+    unsigned char root[HASH_SZ];
+    char filename[PATH_SZ];
+    char hex[2*HASH_SZ+1];
+    char tm[TIME_SZ+1];
+    char sn[SERIAL_HEX+1];
+    idx_entry * e ;
+    X509 * cert=NULL ;
+    FILE * f ;
+    long n ;
+    int i, fd, len=-1 ;
+    char * p ;
+
+    if (log_last_head(&n, root, tm)!=0) {
+        fprintf(stderr, "No tree head in %s\n", log_file(HEADS_FILE, filename));
+        return -1 ;
+    }
+    hash_hex(root, hex);
+    printf("tree %ld %s %s\n", n, hex, tm);
+    if (!serial && !cn)
+        return 0 ;
+
+    for (p=serial ; p && *p ; p++) {
+        *p = toupper((unsigned char)*p);
+    }
+    index_load();
+    e = serial ? index_find_serial(serial) : index_find_cn(cn) ;
+    if (!e) {
+        printf("Not found: %s\n", serial ? serial : cn);
+    } else if (e->leaf<0) {
+        fprintf(stderr, "%s: not in the issuance log\n", e->cn);
+    } else if (e->leaf>=n) {
+        fprintf(stderr, "%s: not covered by a tree head yet\n", e->cn);
+    } else if ((f=fopen(crt_file(e->issuer, e->cn, filename), "r"))==NULL) {
+        fprintf(stderr, "Cannot read %s\n", filename);
+    } else {
+        cert = PEM_read_X509(f, NULL, NULL, NULL);
+        fclose(f);
+        if (cert)
+            serial_str(X509_get_serialNumber(cert), sn);
+        if (!cert || strcmp(sn, e->serial)) {
+            fprintf(stderr, "%s does not match the index\n", filename);
+        } else if ((fd=open(log_file(LOG_FILE, filename), O_RDONLY))<0) {
+            fprintf(stderr, "Cannot read %s\n", filename);
+        } else {
+            len = log_path(fd, e->leaf, 0, n, path);
+            close(fd);
+            if (len<0)
+                fprintf(stderr, "Cannot read %s\n", filename);
+        }
+    }
+    if (len<0) {
+        X509_free(cert);
+        index_free();
+        return -1 ;
+    }
+    log_leaf(cert, leaf);
+    hash_hex(leaf, hex);
+    printf("leaf %ld %s %s\n", e->leaf, e->serial, hex);
+    for (i=0 ; i<len ; i++) {
+        hash_hex(path[i], hex);
+        printf("path %s\n", hex);
+    }
+    i = log_verify(e->leaf, n, leaf, path, len, root);
+    printf("%s: %s\n", e->cn, i==0 ? "included" : "proof does not match");
+    X509_free(cert);
+    index_free();
+    return i ;
+}
+
+/*
+ * Prepare a certificate for pkey from info, ready to be signed by
+ * issuer (NULL for a self-signed root)
+ */
+static X509 * make_cert(struct _certinfo_ * info, X509 * issuer, EVP_PKEY * pkey)
+{
+    X509 * cert ;
+    X509_NAME * name ;
+    STACK_OF(X509_EXTENSION) * exts ;
+    double t0 ;
+    int i, is_ca ;
+
+    /* Assign all certificate fields */
+    cert = X509_new();
+    X509_set_version(cert, 2);
+    if (set_serial128(cert)!=0) {
+        X509_free(cert);
+        return NULL ;
+    }
+    X509_gmtime_adj(X509_get_notBefore(cert), 0);
+    X509_gmtime_adj(X509_get_notAfter(cert), info->days * 24*60*60);
+    X509_set_pubkey(cert, pkey);
+
+    name = X509_get_subject_name(cert);
+    if (info->c[0]) {
+        X509_NAME_add_entry_by_txt(name, "C", MBSTRING_ASC, (unsigned char*)info->c, -1, -1, 0);
+    }
+    X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC, (unsigned char*)info->o, -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char*)info->cn, -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "OU", MBSTRING_ASC, (unsigned char*)info->ou, -1, -1, 0);
+    if (info->l[0]) {
+        X509_NAME_add_entry_by_txt(name, "L", MBSTRING_ASC, (unsigned char *)info->l, -1, -1, 0);
+    }
+    if (info->st[0]) {
+        X509_NAME_add_entry_by_txt(name, "ST", MBSTRING_ASC, (unsigned char *)info->st, -1, -1, 0);
+    }
+
+    /* Set extensions according to profile */
+    t0 = now_usec();
+    if (info->profile!=PROFILE_UNKNOWN) {
+        is_ca = (info->profile==PROFILE_ROOT_CA || info->profile==PROFILE_SUB_CA) ;
+        if (info->profile==PROFILE_ROOT_CA)
+            issuer = cert ;
+        if (!is_ca && info->san[0]) {
+            set_extension(issuer, cert, NID_subject_alt_name, info->san);
+        }
+        exts = profile_exts(profile_of(info), EVP_PKEY_base_id(pkey)==EVP_PKEY_RSA);
+        for (i=0 ; i<sk_X509_EXTENSION_num(exts) ; i++) {
+            X509_add_ext(cert, sk_X509_EXTENSION_value(exts, i), -1);
+        }
+        set_extension(issuer, cert, NID_subject_key_identifier, "hash");
+        set_extension(issuer, cert, NID_authority_key_identifier,
+                      is_ca ? "keyid:always" : "issuer:always,keyid:always");
+    }
+    stats_stage("extensions", t0, 0);
+
+    /* Set issuer */
+    if (info->profile==PROFILE_ROOT_CA) {
+        /* Self-signed */
+        X509_set_issuer_name(cert, name);
+    } else {
+        /* Signed by parent CA */
+        X509_set_issuer_name(cert, X509_get_subject_name(issuer));
+    }
+    return cert ;
+}
+
+
+/*
+ * Path of a file for the identity described by info
+ */
+static char * identity_file(struct _certinfo_ * info, char * suffix, char * path)
+{
+    if (info->profile==PROFILE_ROOT_CA || info->profile==PROFILE_SUB_CA)
+        return ca_file(info->cn, suffix, path);
+    return leaf_file(info->signing_ca, info->cn, suffix, path);
+}
+
+/*
+ * Identity files replace the previous ones when renewing. Otherwise they
+ * are only published if their name is still free.
+ */
+static long identity_write(struct _certinfo_ * info, char * filename, BIO * mem, int mode)
+{
+    return info->replace ? write_bio(filename, mem, mode) : create_bio(filename, mem, mode);
+}
+
+/*
+ * Password-less PKCS#12 bundle of key, certificate and CA chain, built
+ * from what is already in memory. Returns bytes written or -1.
+ */
+static long write_p12(struct _certinfo_ * info, char * filename, EVP_PKEY * pkey,
+                      X509 * cert, X509 * ca_cert)
+{
+    STACK_OF(X509) * chain ;
+    PKCS12 * p12 ;
+    BIO * mem ;
+    long bytes=-1 ;
+    double t0=now_usec() ;
+
+    need_algorithms(ALGS_DIGESTS|ALGS_CIPHERS);
+    /* The chain is kept for the run, PKCS12_create() only copies it */
+    chain = ca_chain(info->signing_ca, ca_cert);
+    p12 = PKCS12_create("", info->cn, pkey, cert, chain, 0, 0,
+                        p12_iter, p12_iter, 0);
+    if (!p12) {
+        fprintf(stderr, "Cannot build PKCS#12 bundle for %s\n", info->cn);
+        return -1 ;
+    }
+    stats_stage("p12", t0, 0);
+    t0 = now_usec();
+    mem = out_buffer();
+    if (i2d_PKCS12_bio(mem, p12))
+        bytes = identity_write(info, filename, mem, 0600);
+    stats_stage("write_p12", t0, bytes);
+    PKCS12_free(p12);
+    return bytes ;
+}
+
+/*
+ * One identity on its way: built by issue_prepare(), signed by
+ * issue_sign(), then written by issue_finish(). Batches sign a whole
+ * window of identities signed by token keys in parallel in between.
+ */
+typedef struct _issue_job_ {
+    struct _certinfo_ info ;    /* copy of the request */
+    X509     * cert ;
+    EVP_PKEY * pkey ;
+    identity   ca ;
+    identity * signing_ca ;     /* as passed by the caller, or NULL */
+    int        own_ca ;         /* ca was loaded here and must be freed */
+    int        claimed ;        /* key and crt names are held, see claim_file() */
+    int        with_p12 ;
+    int        signed_ok ;
+    double     sign_usec ;
+} issue_job ;
+
+/* Files of an identity, in the order they are written */
+static char * identity_suffixes[] = { ".key", ".crt", ".p12", NULL } ;
+
+static void issue_release(issue_job * job)
+{
+    char filename[PATH_SZ];
+
+    if (job->claimed) {
+        unclaim_file(identity_file(&job->info, ".key", filename));
+        unclaim_file(identity_file(&job->info, ".crt", filename));
+        job->claimed = 0 ;
+    }
+    X509_free(job->cert);
+    EVP_PKEY_free(job->pkey);
+    if (job->own_ca) {
+        X509_free(job->ca.cert);
+        EVP_PKEY_free(job->ca.key);
+    }
+    job->cert   = NULL ;
+    job->pkey   = NULL ;
+    job->own_ca = 0 ;
+}
+
+/*
+ * Check, get a key pair and build the unsigned certificate described by
+ * info. The job works on its own copy of info, so the caller may reuse
+ * it right away.
+ * If signing_ca is NULL the signing CA is loaded from info->signing_ca
+ * and released afterwards.
+ * If pkey is NULL a new key pair is generated, otherwise pkey is used
+ * and released in all cases.
+ */
+static int issue_prepare(issue_job * job, struct _certinfo_ * info,
+                         identity * signing_ca, EVP_PKEY * pkey)
+{
+    char filename[PATH_SZ];
+    double t0 ;
+
+    memset(job, 0, sizeof(issue_job));
+    job->info = *info ;
+    info = &job->info ;
+    job->signing_ca = signing_ca ;
+
+    if (info->profile==PROFILE_UNKNOWN) {
+        fprintf(stderr, "Unknown profile: aborting\n");
+        EVP_PKEY_free(pkey);
+        return -1 ;
+    }
+
+    /* Claim both names before any work, unless renewing */
+    if (!info->replace) {
+        if (claim_file(identity_file(info, ".crt", filename))!=0) {
+            fprintf(stderr, "identity named %s already exists in this directory. Exiting now\n", filename);
+            EVP_PKEY_free(pkey);
+            return -1 ;
+        }
+        if (claim_file(identity_file(info, ".key", filename))!=0) {
+            fprintf(stderr, "identity named %s already exists in this directory. Exiting now\n", filename);
+            unclaim_file(identity_file(info, ".crt", filename));
+            EVP_PKEY_free(pkey);
+            return -1 ;
+        }
+        job->claimed = 1 ;
+    }
+    job->with_p12 = (info->profile==PROFILE_CLIENT && p12_iter>0) ;
+    strcpy(info->ou, profile_of(info)->ou);
+
+    if (info->profile != PROFILE_ROOT_CA) {
+        /* Need to load signing CA */
+        if (signing_ca) {
+            job->ca = *signing_ca ;
+        } else if (load_ca(info->signing_ca, &job->ca)!=0) {
+            fprintf(stderr, "Cannot find CA key or certificate\n");
+            EVP_PKEY_free(pkey);
+            issue_release(job);
+            return -1 ;
+        } else {
+            job->own_ca = 1 ;
+        }
+        /* Organization is the same as root */
+        X509_NAME_get_text_by_NID(X509_get_subject_name(job->ca.cert),
+                                  NID_organizationName,
+                                  info->o,
+                                  FIELD_SZ);
+    }
+
+    /* Use a pre-generated key if the pool has one */
+    t0 = now_usec();
+    if (!pkey && (pkey=keypool_take(info->rsa_keysz, info->ec_name))!=NULL) {
+        printf("Using pre-generated key from %s\n", keypool_dir);
+        stats_stage("keypool", t0, 0);
+    }
+    /* Generate key pair unless one was provided */
+    if (!pkey) {
+        t0 = now_usec();
+        pkey = generate_key(info->rsa_keysz, info->ec_name, 1);
+        if (!pkey) {
+            issue_release(job);
+            return -1 ;
+        }
+        stats_stage("keygen", t0, 0);
+    }
+    job->pkey = pkey ;
+
+    /* Assign all certificate fields */
+    if (info->profile==PROFILE_ROOT_CA) {
+        job->ca.cert = NULL ;
+        job->ca.key  = pkey ;
+    }
+    if ((job->cert=make_cert(info, job->ca.cert, pkey))==NULL) {
+        issue_release(job);
+        return -1 ;
+    }
+    return 0 ;
+}
+
+/*
+ * Sign a prepared certificate. Only touches the job, so that several
+ * jobs can be signed at once from different threads.
+ */
+static void issue_sign(issue_job * job, EVP_PKEY * key)
+{
+    double t0=now_usec() ;
+
+    job->signed_ok = X509_sign(job->cert, key, sign_md(key))>0 ;
+    job->sign_usec = now_usec()-t0 ;
+}
+
+/*
+ * Write key, certificate and index record for a signed job, then
+ * release it.
+ */
+static int issue_finish(issue_job * job)
+{
+    struct _certinfo_ * info = &job->info ;
+    char filename[PATH_SZ];
+    char base[PATH_SZ];
+    BIO  * mem ;
+    long   bytes ;
+    double t0 ;
+    int    i, written=0 ;
+
+    stats_stage("sign", now_usec()-job->sign_usec, 0);
+    if (!job->signed_ok) {
+        fprintf(stderr, "Cannot sign certificate for %s\n", info->cn);
+        issue_release(job);
+        return -1 ;
+    }
+
+    printf("Saving results to %s.[crt|key%s]\n", identity_file(info, "", base),
+           job->with_p12 ? "|p12" : "");
+    identity_file(info, ".key", filename);
+    t0 = now_usec();
+    mem = out_buffer();
+    PEM_write_bio_PrivateKey(mem, job->pkey, NULL, NULL, 0, NULL, NULL);
+    if ((bytes=identity_write(info, filename, mem, 0600))>=0)
+        written++;
+    stats_stage("write_key", t0, bytes);
+    t0 = now_usec();
+    identity_file(info, ".crt", filename);
+    mem = out_buffer();
+    PEM_write_bio_X509(mem, job->cert);
+    if (bytes>=0 && (bytes=identity_write(info, filename, mem, 0644))>=0)
+        written++;
+    stats_stage("write_crt", t0, bytes);
+    if (bytes>=0 && job->with_p12 &&
+        (bytes=write_p12(info, identity_file(info, ".p12", filename), job->pkey,
+                         job->cert, job->ca.cert))>=0)
+        written++;
+    /* Do not keep the private key around in the buffer */
+    out_buffer();
+    if (bytes<0) {
+        /* Half an identity would hold its name: take back what was written */
+        for (i=0 ; i<written ; i++) {
+            write_cancel(identity_file(info, identity_suffixes[i], filename),
+                         !info->replace);
+        }
+        issue_release(job);
+        return -1 ;
+    }
+    t0 = now_usec();
+    log_issue(job->cert,
+              info->profile==PROFILE_ROOT_CA ? info->cn : info->signing_ca,
+              info->cn);
+    stats_stage("write_index", t0, 0);
+    issue_release(job);
+    printf("done\n");
+
+    return 0;
+}
+
+/*
+ * After a write group: undo an identity whose files could not all be
+ * published. The files it did publish are removed, unless it replaced
+ * a previous certificate, and its queued log leaf and index record are
+ * dropped. Returns -1 if it was not published.
+ */
+static int issue_published(struct _certinfo_ * info)
+{
+    char filename[PATH_SZ];
+    int i, failed=0 ;
+
+    for (i=0 ; identity_suffixes[i] ; i++) {
+        if (write_group_status(identity_file(info, identity_suffixes[i], filename))<0)
+            failed = 1 ;
+    }
+    if (!failed)
+        return 0 ;
+    for (i=0 ; identity_suffixes[i] && !info->replace ; i++) {
+        if (write_group_status(identity_file(info, identity_suffixes[i], filename))>0)
+            unlink(filename);
+    }
+    log_drop(info->profile==PROFILE_ROOT_CA ? info->cn : info->signing_ca, info->cn);
+    return -1 ;
+}
+
+/*
+ * Create identity, see issue_prepare() for arguments
+ */
+static int issue_identity(struct _certinfo_ * info, identity * signing_ca, EVP_PKEY * pkey)
+{
+    issue_job job ;
+
+    if (issue_prepare(&job, info, signing_ca, pkey)!=0)
+        return -1 ;
+    issue_sign(&job, job.ca.key);
+    return issue_finish(&job);
+}
+
+/*
+ * Create identity, accounting time per stage when stats are enabled
+ */
+int build_identity(struct _certinfo_ * info, identity * signing_ca, EVP_PKEY * pkey)
+{
+    int ret ;
+
+    stats_begin("issue", info->cn);
+    ret = issue_identity(info, signing_ca, pkey);
+    stats_end(ret);
+    return ret ;
+}
+
+static X509_CRL * load_crl_file(char * filename)
+{
+    FILE * fp ;
+    BIO  * in ;
+    X509_CRL * crl ;
+
+    in = BIO_new(BIO_s_file());
+    if ((fp=fopen(filename, "rb"))==NULL) {
+        BIO_free(in);
+        return NULL ;
+    }
+    BIO_set_fp(in, fp, BIO_NOCLOSE);
+    crl = PEM_read_bio_X509_CRL(in, NULL, NULL, NULL);
+    fclose(fp);
+    BIO_free(in);
+    return crl ;
+}
+
+static X509_REVOKED * make_revoked(ASN1_INTEGER * serial, ASN1_TIME * tm, int reason)
+{
+    X509_REVOKED * rev ;
+    ASN1_ENUMERATED * code ;
+
+    rev = X509_REVOKED_new();
+    X509_REVOKED_set_serialNumber(rev, serial);
+    X509_REVOKED_set_revocationDate(rev, tm);
+    /* Unspecified is expressed by leaving the reason out */
+    if (reason>0) {
+        code = ASN1_ENUMERATED_new();
+        ASN1_ENUMERATED_set(code, reason);
+        X509_REVOKED_add1_ext_i2d(rev, NID_crl_reason, code, 0, 0);
+        ASN1_ENUMERATED_free(code);
+    }
+    return rev ;
+}
+
+/*
+ * Streaming CRL access. A CRL is kept as its DER encoding and revoked
+ * entries are walked one at a time straight from it, without building an
+ * X509_CRL and its stack of X509_REVOKED. Updating a CRL re-emits the TBS
+ * with existing entries copied byte for byte, merged with a sorted run of
+ * new entries, then signs it again.
+ */
+typedef struct _crl_der_ {
+    unsigned char * der ;
+    long   len ;
+    const unsigned char * version ;     /* INTEGER element, NULL for v1 */
+    long   version_len ;
+    const unsigned char * head ;        /* signature algorithm + issuer */
+    long   head_len ;
+    const unsigned char * sig_alg ;     /* outer signature algorithm */
+    long   sig_alg_len ;
+    const unsigned char * revoked ;     /* contents of revokedCertificates */
+    long   revoked_len ;
+    const unsigned char * exts ;        /* Extensions, inside [0] */
+    long   exts_len ;
+} crl_der ;
+
+typedef struct _crl_entry_ {
+    const unsigned char * der ;         /* whole entry */
+    long   len ;
+    const unsigned char * serial_der ;  /* INTEGER element */
+    long   serial_der_len ;
+    const unsigned char * serial ;      /* INTEGER contents */
+    long   serial_len ;
+    const unsigned char * date ;        /* Time element */
+    long   date_len ;
+    const unsigned char * exts ;        /* Extensions element, or NULL */
+    long   exts_len ;
+} crl_entry ;
+
+/*
+ * Read one DER element at *p, move *p past it.
+ * Returns 0 and the element tag, class and contents, or -1.
+ */
+static int der_element(const unsigned char ** p, const unsigned char * end,
+                       int * tag, int * xclass,
+                       const unsigned char ** content, long * content_len)
+{
+    int ret ;
+
+    if (*p>=end)
+        return -1 ;
+    ret = ASN1_get_object(p, content_len, tag, xclass, end-*p);
+    if ((ret & 0x80) || ret==0x21)
+        return -1 ;
+    *content = *p ;
+    *p += *content_len ;
+    return 0 ;
+}
+
+static void crl_der_free(crl_der * c)
+{
+    OPENSSL_free(c->der);
+    memset(c, 0, sizeof(crl_der));
+}
+
+/*
+ * Load a PEM CRL and locate the parts of its TBS
+ */
+static int crl_der_load(char * filename, crl_der * c)
+{
+    const unsigned char * p ;
+    const unsigned char * end ;
+    const unsigned char * q ;
+    const unsigned char * tbs ;
+    const unsigned char * tbs_end ;
+    const unsigned char * e ;
+    long   len ;
+    int    tag, xclass ;
+    BIO  * in ;
+
+    memset(c, 0, sizeof(crl_der));
+    if ((in=BIO_new_file(filename, "rb"))==NULL)
+        return -1 ;
+    if (!PEM_bytes_read_bio(&c->der, &c->len, NULL, PEM_STRING_X509_CRL, in, NULL, NULL)) {
+        BIO_free(in);
+        return -1 ;
+    }
+    BIO_free(in);
+
+    /* CertificateList ::= SEQUENCE { tbsCertList, signatureAlgorithm, signature } */
+    p = c->der ;
+    end = c->der + c->len ;
+    if (der_element(&p, end, &tag, &xclass, &q, &len)!=0 || tag!=V_ASN1_SEQUENCE)
+        goto bad ;
+    end = q + len ;
+    if (der_element(&q, end, &tag, &xclass, &tbs, &len)!=0 || tag!=V_ASN1_SEQUENCE)
+        goto bad ;
+    tbs_end = tbs + len ;
+    c->sig_alg = q ;
+    if (der_element(&q, end, &tag, &xclass, &e, &len)!=0 || tag!=V_ASN1_SEQUENCE)
+        goto bad ;
+    c->sig_alg_len = q - c->sig_alg ;
+
+    /* Optional version, signature, issuer */
+    e = tbs ;
+    if (der_element(&tbs, tbs_end, &tag, &xclass, &q, &len)!=0)
+        goto bad ;
+    if (tag==V_ASN1_INTEGER) {
+        c->version = e ;
+        c->version_len = tbs - e ;
+        e = tbs ;
+        if (der_element(&tbs, tbs_end, &tag, &xclass, &q, &len)!=0)
+            goto bad ;
+    }
+    c->head = e ;
+    if (der_element(&tbs, tbs_end, &tag, &xclass, &q, &len)!=0 || tag!=V_ASN1_SEQUENCE)
+        goto bad ;
+    c->head_len = tbs - c->head ;
+
+    /* thisUpdate, then optional nextUpdate, revoked, extensions */
+    if (der_element(&tbs, tbs_end, &tag, &xclass, &q, &len)!=0)
+        goto bad ;
+    while (tbs<tbs_end) {
+        if (der_element(&tbs, tbs_end, &tag, &xclass, &q, &len)!=0)
+            goto bad ;
+        if (xclass==V_ASN1_UNIVERSAL && tag==V_ASN1_SEQUENCE) {
+            c->revoked = q ;
+            c->revoked_len = len ;
+        } else if (xclass==V_ASN1_CONTEXT_SPECIFIC && tag==0) {
+            c->exts = q ;
+            c->exts_len = len ;
+        }
+    }
+    return 0 ;
+
+bad:
+    fprintf(stderr, "Cannot parse CRL %s\n", filename);
+    crl_der_free(c);
+    return -1 ;
+}
+
+/*
+ * Next revoked entry at *p: 1 if found, 0 at the end, -1 on error
+ */
+static int crl_der_next(const unsigned char ** p, const unsigned char * end,
+                        crl_entry * e)
+{
+    const unsigned char * q ;
+    const unsigned char * q_end ;
+    const unsigned char * content ;
+    int  tag, xclass ;
+    long len ;
+
+    if (*p>=end)
+        return 0 ;
+    e->der = *p ;
+    if (der_element(p, end, &tag, &xclass, &q, &len)!=0 || tag!=V_ASN1_SEQUENCE)
+        return -1 ;
+    e->len = *p - e->der ;
+    q_end = q + len ;
+    e->serial_der = q ;
+    if (der_element(&q, q_end, &tag, &xclass, &e->serial, &e->serial_len)!=0 ||
+        tag!=V_ASN1_INTEGER)
+        return -1 ;
+    e->serial_der_len = q - e->serial_der ;
+    e->date = q ;
+    if (der_element(&q, q_end, &tag, &xclass, &content, &len)!=0)
+        return -1 ;
+    e->date_len = q - e->date ;
+    e->exts = NULL ;
+    e->exts_len = 0 ;
+    if (q<q_end) {
+        e->exts = q ;
+        if (der_element(&q, q_end, &tag, &xclass, &content, &len)!=0)
+            return -1 ;
+        e->exts_len = q - e->exts ;
+    }
+    return 1 ;
+}
+
+/*
+ * Order of two positive DER INTEGER contents, as X509_CRL_sort does
+ */
+static int der_serial_cmp(const unsigned char * a, long a_len,
+                          const unsigned char * b, long b_len)
+{
+    if (a_len!=b_len)
+        return a_len<b_len ? -1 : 1 ;
+    return memcmp(a, b, a_len);
+}
+
+static int der_serial_to_bin(const unsigned char * serial, long len, unsigned char * out)
+{
+    /* Skip the leading zero of positive numbers */
+    while (len>1 && serial[0]==0) {
+        serial++;
+        len--;
+    }
+    if (len>SERIAL_SZ || (serial[0] & 0x80))
+        return -1 ;
+    memset(out, 0, SERIAL_SZ);
+    memcpy(out+SERIAL_SZ-len, serial, len);
+    return 0 ;
+}
+
+/*
+ * Serials of all revoked entries as SERIAL_SZ-byte strings.
+ * Returns their number or -1.
+ */
+static int crl_der_serials(crl_der * c, unsigned char ** serials)
+{
+    const unsigned char * p = c->revoked ;
+    crl_entry e ;
+    int n=0, sz=1024, ret ;
+
+    *serials = malloc(sz * SERIAL_SZ);
+    while ((ret=crl_der_next(&p, c->revoked+c->revoked_len, &e))==1) {
+        if (n==sz) {
+            sz *= 2 ;
+            *serials = realloc(*serials, sz * SERIAL_SZ);
+        }
+        if (der_serial_to_bin(e.serial, e.serial_len, *serials+n*SERIAL_SZ)==0)
+            n++;
+    }
+    if (ret<0) {
+        free(*serials);
+        *serials = NULL ;
+        return -1 ;
+    }
+    return n ;
+}
+
+/*
+ * Sign the DER encoding of a TBS structure
+ */
+static unsigned char * sign_der(EVP_PKEY * key, const unsigned char * tbs, long tbs_len,
+                                size_t * sig_len)
+{
+    EVP_MD_CTX * ctx ;
+    unsigned char * sig = NULL ;
+    int ok ;
+
+    ctx = EVP_MD_CTX_create();
+    ok = EVP_DigestSignInit(ctx, NULL, sign_md(key), NULL, key)==1 ;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+    /* One-shot, as required by Ed25519 */
+    ok = ok && EVP_DigestSign(ctx, NULL, sig_len, tbs, tbs_len)==1 ;
+    ok = ok && (sig=OPENSSL_malloc(*sig_len))!=NULL ;
+    ok = ok && EVP_DigestSign(ctx, sig, sig_len, tbs, tbs_len)==1 ;
+#else
+    ok = ok && EVP_DigestSignUpdate(ctx, tbs, tbs_len)==1 ;
+    ok = ok && EVP_DigestSignFinal(ctx, NULL, sig_len)==1 ;
+    ok = ok && (sig=OPENSSL_malloc(*sig_len))!=NULL ;
+    ok = ok && EVP_DigestSignFinal(ctx, sig, sig_len)==1 ;
+#endif
+    EVP_MD_CTX_destroy(ctx);
+    if (!ok) {
+        OPENSSL_free(sig);
+        return NULL ;
+    }
+    return sig ;
+}
+
+/*
+ * Re-emit a CRL: existing entries merged with new revoked certificates
+ * (sorted by serial), thisUpdate/nextUpdate set to this_tm/next_tm and the
+ * CRL number increased by one. The CRL is signed with ca and written to
+ * filename. New entries carry reason. Certificates found to be already
+ * in the CRL are freed and removed from added.
+ * On success, returns 0 with the new and previous CRL numbers (prev is
+ * NULL if there was none) and the sorted serials of all entries.
+ */
+static int crl_der_update(crl_der * c, identity * ca, X509 ** added, int * n_added,
+                          int reason, ASN1_TIME * this_tm, ASN1_TIME * next_tm, char * filename,
+                          ASN1_INTEGER ** crlnum, ASN1_INTEGER ** prev,
+                          unsigned char ** serials, int * n_serials)
+{
+    static const unsigned char v2[] = { V_ASN1_INTEGER, 1, 1 } ;
+    STACK_OF(X509_EXTENSION) * exts = NULL ;
+    const unsigned char * p ;
+    const unsigned char * r ;
+    const unsigned char * r_end ;
+    unsigned char ** new_der ;
+    unsigned char * this_der = NULL ;
+    unsigned char * next_der = NULL ;
+    unsigned char * exts_der = NULL ;
+    unsigned char * tbs ;
+    unsigned char * sig ;
+    unsigned char * out ;
+    unsigned char * w ;
+    crl_entry * new_e ;
+    crl_entry * next ;
+    crl_entry e ;
+    X509_REVOKED * rev ;
+    char hex[SERIAL_HEX+1];
+    size_t sig_len ;
+    long   rev_len, tbs_len, tbs_sz, sig_sz, crl_len ;
+    int    this_len, next_len, exts_len ;
+    int    i, n, ret, has, sz=1024 ;
+    double t0=now_usec() ;
+    long   bytes ;
+    BIGNUM * bn ;
+    BIO * mem ;
+
+    *prev = NULL ;
+    *crlnum = NULL ;
+    *serials = NULL ;
+
+    /* Bump the CRL number */
+    p = c->exts ;
+    if (c->exts && (exts=d2i_X509_EXTENSIONS(NULL, &p, c->exts_len))==NULL) {
+        fprintf(stderr, "Cannot decode CRL extensions\n");
+        return -1 ;
+    }
+    if ((*prev=X509V3_get_d2i(exts, NID_crl_number, NULL, NULL))!=NULL) {
+        bn = ASN1_INTEGER_to_BN(*prev, NULL);
+        BN_add_word(bn, 1);
+        *crlnum = BN_to_ASN1_INTEGER(bn, NULL);
+        BN_free(bn);
+    } else {
+        *crlnum = ASN1_INTEGER_new();
+        ASN1_INTEGER_set(*crlnum, 1);
+    }
+    X509V3_add1_i2d(&exts, NID_crl_number, *crlnum, 0, X509V3_ADD_REPLACE);
+    exts_len = i2d_X509_EXTENSIONS(exts, &exts_der);
+    sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+
+    /* Encode new entries */
+    new_der = malloc((*n_added+1) * sizeof(unsigned char *));
+    new_e   = malloc((*n_added+1) * sizeof(crl_entry));
+    for (i=0 ; i<*n_added ; i++) {
+        rev = make_revoked(X509_get_serialNumber(added[i]), this_tm, reason);
+        new_der[i] = NULL ;
+        n = i2d_X509_REVOKED(rev, &new_der[i]);
+        X509_REVOKED_free(rev);
+        p = new_der[i] ;
+        crl_der_next(&p, new_der[i]+n, &new_e[i]);
+    }
+
+    /* Drop those already listed */
+    r = c->revoked ;
+    r_end = c->revoked + c->revoked_len ;
+    has = crl_der_next(&r, r_end, &e);
+    for (i=0, n=0 ; i<*n_added ; i++) {
+        while (has==1 && der_serial_cmp(e.serial, e.serial_len,
+                                        new_e[i].serial, new_e[i].serial_len)<0)
+            has = crl_der_next(&r, r_end, &e);
+        if (has==1 && !der_serial_cmp(e.serial, e.serial_len,
+                                      new_e[i].serial, new_e[i].serial_len)) {
+            serial_str(X509_get_serialNumber(added[i]), hex);
+            fprintf(stderr, "Already revoked: %s\n", hex);
+            X509_free(added[i]);
+            OPENSSL_free(new_der[i]);
+            continue ;
+        }
+        added[n] = added[i] ;
+        new_der[n] = new_der[i] ;
+        new_e[n++] = new_e[i] ;
+    }
+    *n_added = n ;
+    if (has<0) {
+        fprintf(stderr, "Cannot parse revoked entries in %s\n", filename);
+        ret = -1 ;
+        goto done ;
+    }
+
+    /* Size of the new TBS */
+    this_len = i2d_ASN1_TIME(this_tm, &this_der);
+    next_len = i2d_ASN1_TIME(next_tm, &next_der);
+    rev_len = c->revoked_len ;
+    for (i=0 ; i<*n_added ; i++)
+        rev_len += new_e[i].len ;
+    tbs_len = (c->version ? c->version_len : (long)sizeof(v2)) + c->head_len +
+              this_len + next_len + ASN1_object_size(1, exts_len, 0) ;
+    if (rev_len>0)
+        tbs_len += ASN1_object_size(1, rev_len, V_ASN1_SEQUENCE);
+    tbs_sz = ASN1_object_size(1, tbs_len, V_ASN1_SEQUENCE);
+
+    /* Emit it, merging entries and collecting serials on the way */
+    tbs = w = malloc(tbs_sz);
+    ASN1_put_object(&w, 1, tbs_len, V_ASN1_SEQUENCE, V_ASN1_UNIVERSAL);
+    if (c->version) {
+        memcpy(w, c->version, c->version_len);
+        w += c->version_len ;
+    } else {
+        memcpy(w, v2, sizeof(v2));
+        w += sizeof(v2) ;
+    }
+    memcpy(w, c->head, c->head_len);
+    w += c->head_len ;
+    memcpy(w, this_der, this_len);
+    w += this_len ;
+    memcpy(w, next_der, next_len);
+    w += next_len ;
+    *serials = malloc(sz * SERIAL_SZ);
+    *n_serials = 0 ;
+    if (rev_len>0) {
+        ASN1_put_object(&w, 1, rev_len, V_ASN1_SEQUENCE, V_ASN1_UNIVERSAL);
+        r = c->revoked ;
+        has = crl_der_next(&r, r_end, &e);
+        i = 0 ;
+        while (has==1 || i<*n_added) {
+            if (has==1 && (i==*n_added ||
+                der_serial_cmp(e.serial, e.serial_len, new_e[i].serial, new_e[i].serial_len)<0)) {
+                next = &e ;
+            } else {
+                next = &new_e[i] ;
+            }
+            memcpy(w, next->der, next->len);
+            w += next->len ;
+            if (*n_serials==sz) {
+                sz *= 2 ;
+                *serials = realloc(*serials, sz * SERIAL_SZ);
+            }
+            if (der_serial_to_bin(next->serial, next->serial_len,
+                                  *serials + *n_serials*SERIAL_SZ)==0)
+                (*n_serials)++;
+            if (next==&e) {
+                has = crl_der_next(&r, r_end, &e);
+            } else {
+                i++;
+            }
+        }
+    }
+    ASN1_put_object(&w, 1, exts_len, 0, V_ASN1_CONTEXT_SPECIFIC);
+    memcpy(w, exts_der, exts_len);
+
+    stats_stage("merge", t0, 0);
+
+    /* CertificateList: TBS, signature algorithm, signature */
+    t0 = now_usec();
+    if ((sig=sign_der(ca->key, tbs, tbs_sz, &sig_len))==NULL) {
+        fprintf(stderr, "Cannot sign CRL\n");
+        free(tbs);
+        ret = -1 ;
+        goto done ;
+    }
+    sig_sz  = ASN1_object_size(0, sig_len+1, V_ASN1_BIT_STRING);
+    crl_len = tbs_sz + c->sig_alg_len + sig_sz ;
+    out = w = malloc(ASN1_object_size(1, crl_len, V_ASN1_SEQUENCE));
+    ASN1_put_object(&w, 1, crl_len, V_ASN1_SEQUENCE, V_ASN1_UNIVERSAL);
+    memcpy(w, tbs, tbs_sz);
+    w += tbs_sz ;
+    memcpy(w, c->sig_alg, c->sig_alg_len);
+    w += c->sig_alg_len ;
+    ASN1_put_object(&w, 0, sig_len+1, V_ASN1_BIT_STRING, V_ASN1_UNIVERSAL);
+    *w++ = 0 ;  /* no unused bits */
+    memcpy(w, sig, sig_len);
+    w += sig_len ;
+    free(tbs);
+    OPENSSL_free(sig);
+    stats_stage("sign", t0, 0);
+
+    t0 = now_usec();
+    mem = BIO_new(BIO_s_mem());
+    PEM_write_bio(mem, PEM_STRING_X509_CRL, "", out, w-out);
+    bytes = write_bio(filename, mem, 0644);
+    ret = bytes<0 ? -1 : 0 ;
+    BIO_free(mem);
+    free(out);
+    stats_stage("write_crl", t0, bytes);
+
+done:
+    for (i=0 ; i<*n_added ; i++)
+        OPENSSL_free(new_der[i]);
+    free(new_der);
+    free(new_e);
+    OPENSSL_free(this_der);
+    OPENSSL_free(next_der);
+    OPENSSL_free(exts_der);
+    if (ret!=0) {
+        ASN1_INTEGER_free(*prev);
+        ASN1_INTEGER_free(*crlnum);
+        free(*serials);
+        *prev = NULL ;
+        *crlnum = NULL ;
+        *serials = NULL ;
+    }
+    return ret ;
+}
+
+/*
+ * Revoked serials sidecar: <ca>.rev holds the serials listed in <ca>.crl
+ * as sorted, fixed-width SERIAL_SZ-byte big-endian numbers, so that
+ * revocation status can be checked with a binary search on a mmap-ed file
+ * without parsing the CRL.
+ */
+static int serial_to_bin(ASN1_INTEGER * serial, unsigned char * out)
+{
+    BIGNUM * bn ;
+    int len ;
+
+    bn = ASN1_INTEGER_to_BN(serial, NULL);
+    len = BN_num_bytes(bn);
+    if (BN_is_negative(bn) || len>SERIAL_SZ) {
+        BN_free(bn);
+        return -1 ;
+    }
+    memset(out, 0, SERIAL_SZ);
+    BN_bn2bin(bn, out+SERIAL_SZ-len);
+    BN_free(bn);
+    return 0 ;
+}
+
+static int hex_to_serial(char * hex, unsigned char * out)
+{
+    int i, len, v ;
+
+    if (!strncmp(hex, "0x", 2) || !strncmp(hex, "0X", 2))
+        hex += 2 ;
+    len = strlen(hex);
+    if (len==0 || len>SERIAL_HEX)
+        return -1 ;
+    memset(out, 0, SERIAL_SZ);
+    for (i=0 ; i<len ; i++) {
+        if (!isxdigit((unsigned char)hex[len-1-i]))
+            return -1 ;
+        v = isdigit((unsigned char)hex[len-1-i]) ?
+            hex[len-1-i]-'0' : toupper((unsigned char)hex[len-1-i])-'A'+10 ;
+        out[SERIAL_SZ-1-i/2] |= (i&1) ? v<<4 : v ;
+    }
+    return 0 ;
+}
+
+static int serial_bin_cmp(const void * a, const void * b)
+{
+    return memcmp(a, b, SERIAL_SZ);
+}
+
+/*
+ * Write n serials to <ca>.rev, sorting them in place
+ */
+static int write_serial_file(char * ca_name, unsigned char * serials, int n)
+{
+    char filename[PATH_SZ];
+    double t0 ;
+    long bytes ;
+
+    qsort(serials, n, SERIAL_SZ, serial_bin_cmp);
+
+    /* Replace the file at once, readers may have it mapped */
+    t0 = now_usec();
+    ca_file(ca_name, ".rev", filename);
+    bytes = write_file(filename, (char *)serials, (long)n*SERIAL_SZ, 0644);
+    if (bytes<0)
+        return -1 ;
+    stats_stage("write_rev", t0, bytes);
+    return 0 ;
+}
+
+/*
+ * Build <ca>.rev from the CRL: 0 if done, 1 if there is no CRL, -1 on error
+ */
+static int rebuild_serial_file(char * ca_name)
+{
+    char filename[PATH_SZ];
+    unsigned char * serials ;
+    crl_der c ;
+    int n, ret ;
+
+    ca_file(ca_name, ".crl", filename);
+    if (access(filename, F_OK)!=0)
+        return 1 ;
+    if (crl_der_load(filename, &c)!=0)
+        return -1 ;
+    n = crl_der_serials(&c, &serials);
+    crl_der_free(&c);
+    if (n<0)
+        return -1 ;
+    ret = write_serial_file(ca_name, serials, n);
+    free(serials);
+    return ret ;
+}
+
+/*
+ * Look for a serial in <ca>.rev: 1 if revoked, 0 if not, -1 on error
+ */
+static int serial_file_find(char * ca_name, unsigned char * serial)
+{
+    char filename[PATH_SZ];
+    struct stat st ;
+    void * map ;
+    int fd, found ;
+
+    ca_file(ca_name, ".rev", filename);
+    if ((fd=open(filename, O_RDONLY))<0)
+        return -1 ;
+    if (fstat(fd, &st)!=0 || st.st_size%SERIAL_SZ) {
+        close(fd);
+        return -1 ;
+    }
+    if (st.st_size==0) {
+        close(fd);
+        return 0 ;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map==MAP_FAILED)
+        return -1 ;
+    found = bsearch(serial, map, st.st_size/SERIAL_SZ, SERIAL_SZ,
+                    serial_bin_cmp)!=NULL ;
+    munmap(map, st.st_size);
+    return found ;
+}
+
+/*
+ * Revocation status for a serial (hex) or a certificate name.
+ * Returns 0 if valid, 1 if revoked, -1 if status cannot be determined.
+ */
+int cert_status(char * ca_name, char * serial, char * name)
+{
+    unsigned char bin[SERIAL_SZ];
+    char filename[PATH_SZ];
+    idx_entry * e ;
+    X509 * cert ;
+    FILE * f ;
+    int ret ;
+
+    if (serial) {
+        if (hex_to_serial(serial, bin)!=0) {
+            fprintf(stderr, "Invalid serial: %s\n", serial);
+            return -1 ;
+        }
+    } else {
+        /* Get serial from the index, from the certificate otherwise */
+        index_load();
+        if ((e=index_find_issued(ca_name, name))!=NULL) {
+            ret = hex_to_serial(e->serial, bin);
+        } else {
+            crt_file(ca_name, name, filename);
+            if ((f=fopen(filename, "r"))==NULL) {
+                fprintf(stderr, "Cannot find: %s\n", name);
+                index_free();
+                return -1 ;
+            }
+            cert = PEM_read_X509(f, NULL, NULL, NULL);
+            fclose(f);
+            ret = cert ? serial_to_bin(X509_get_serialNumber(cert), bin) : -1 ;
+            X509_free(cert);
+        }
+        index_free();
+        if (ret!=0) {
+            fprintf(stderr, "Cannot get serial for: %s\n", name);
+            return -1 ;
+        }
+    }
+
+    if ((ret=serial_file_find(ca_name, bin))<0) {
+        /* No sidecar yet: build it once from the CRL */
+        if ((ret=rebuild_serial_file(ca_name))==0) {
+            ret = serial_file_find(ca_name, bin);
+        } else if (ret==1) {
+            ret = 0 ;
+        }
+    }
+    if (ret<0) {
+        fprintf(stderr, "Cannot read %s.rev\n", ca_name);
+        return -1 ;
+    }
+    printf("%s: %s\n", serial ? serial : name, ret ? "revoked" : "valid");
+    return ret ;
+}
+
+static int write_crl(X509_CRL * crl, char * filename, char * stage)
+{
+    BIO  * out ;
+    long   bytes ;
+    double t0=now_usec() ;
+
+    out = BIO_new(BIO_s_mem());
+    PEM_write_bio_X509_CRL(out, crl);
+    bytes = write_bio(filename, out, 0644);
+    BIO_free(out);
+    if (bytes<0)
+        return -1 ;
+    stats_stage(stage, t0, bytes);
+    return 0 ;
+}
+
+/*
+ * Increase the CRL number by one, or set it to 1 for a new CRL.
+ * Returns the previous CRL number (to be freed), NULL for a new CRL.
+ */
+static ASN1_INTEGER * crl_next_number(X509_CRL * crl)
+{
+    ASN1_INTEGER * crlnum ;
+    ASN1_INTEGER * prev ;
+    BIGNUM * b_crlnum ;
+
+    if ((crlnum = X509_CRL_get_ext_d2i(crl, NID_crl_number, 0, 0))==NULL) {
+        crlnum = ASN1_INTEGER_new();
+        ASN1_INTEGER_set(crlnum, 1);
+        X509_CRL_add1_ext_i2d(crl, NID_crl_number, crlnum, 0, 0);
+        ASN1_INTEGER_free(crlnum);
+        return NULL ;
+    }
+    prev = ASN1_INTEGER_dup(crlnum);
+    b_crlnum = ASN1_INTEGER_to_BN(crlnum, NULL);
+    BN_add_word(b_crlnum, 1);
+    BN_to_ASN1_INTEGER(b_crlnum, crlnum);
+    BN_free(b_crlnum);
+    X509_CRL_add1_ext_i2d(crl, NID_crl_number, crlnum, 0, X509V3_ADD_REPLACE_EXISTING);
+    ASN1_INTEGER_free(crlnum);
+    return prev ;
+}
+
+/*
+ * Reason code of a revoked entry, 0 (unspecified) when absent
+ */
+static int crl_entry_reason(crl_entry * e)
+{
+    const unsigned char * q ;
+    STACK_OF(X509_EXTENSION) * exts ;
+    ASN1_ENUMERATED * code ;
+    int reason=0 ;
+
+    if (!e->exts)
+        return 0 ;
+    q = e->exts ;
+    if ((exts=d2i_X509_EXTENSIONS(NULL, &q, e->exts_len))==NULL)
+        return 0 ;
+    if ((code=X509V3_get_d2i(exts, NID_crl_reason, NULL, NULL))!=NULL) {
+        reason = ASN1_ENUMERATED_get(code);
+        ASN1_ENUMERATED_free(code);
+    }
+    sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+    if (reason<0 || reason>=N_REASONS || !crl_reasons[reason])
+        return 0 ;
+    return reason ;
+}
+
+/*
+ * Print a string as a quoted field: JSON escapes or CSV doubled quotes
+ */
+static void put_quoted(FILE * f, char * s, int json)
+{
+    fputc('"', f);
+    for ( ; *s ; s++) {
+        if (json && (*s=='"' || *s=='\\'))
+            fputc('\\', f);
+        else if (!json && *s=='"')
+            fputc('"', f);
+        if (json && (unsigned char)*s<0x20)
+            fprintf(f, "\\u%04x", (unsigned char)*s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/*
+ * Export all revoked entries in one pass, joined with the index for CNs.
+ * json: an array of objects, csv: one line per entry with a header,
+ * bin: fixed 32-byte records of a 16-byte serial, a 64-bit big-endian
+ * revocation time in seconds since the epoch, a reason byte and padding.
+ */
+static int export_crl(crl_der * c, char * filename)
+{
+    const unsigned char * p ;
+    const unsigned char * q ;
+    unsigned char rec[32];
+    char hex[SERIAL_HEX+1];
+    char gt[TIME_SZ+1];
+    char date[32];
+    ASN1_INTEGER * serial ;
+    ASN1_TIME * tm ;
+    ASN1_TIME * epoch ;
+    idx_entry * ie ;
+    crl_entry e ;
+    long long secs ;
+    int day, sec ;
+    int reason ;
+    int n=0 ;
+    int ret, i ;
+
+    index_load();
+    epoch = ASN1_TIME_set(NULL, 0);
+    if (!strcmp(out_format, "json"))
+        printf("[\n");
+    else if (!strcmp(out_format, "csv"))
+        printf("serial,revocation_date,reason,cn\n");
+    p = c->revoked ;
+    while ((ret=crl_der_next(&p, c->revoked+c->revoked_len, &e))==1) {
+        q = e.date ;
+        if ((tm=d2i_ASN1_TIME(NULL, &q, e.date_len))==NULL) {
+            ret = -1 ;
+            break ;
+        }
+        reason = crl_entry_reason(&e);
+        if (!strcmp(out_format, "bin")) {
+            memset(rec, 0, sizeof(rec));
+            if (der_serial_to_bin(e.serial, e.serial_len, rec)!=0 ||
+                !ASN1_TIME_diff(&day, &sec, epoch, tm)) {
+                ASN1_TIME_free(tm);
+                ret = -1 ;
+                break ;
+            }
+            secs = (long long)day*86400 + sec ;
+            for (i=0 ; i<8 ; i++) {
+                rec[SERIAL_SZ+i] = (unsigned char)(secs >> (56-8*i));
+            }
+            rec[SERIAL_SZ+8] = (unsigned char)reason ;
+            fwrite(rec, 1, sizeof(rec), stdout);
+            ASN1_TIME_free(tm);
+            n++;
+            continue ;
+        }
+        q = e.serial_der ;
+        serial = d2i_ASN1_INTEGER(NULL, &q, e.serial_der_len);
+        hex[0] = 0 ;
+        if (serial)
+            serial_str(serial, hex);
+        ASN1_INTEGER_free(serial);
+        /* YYYYMMDDHHMMSSZ to ISO 8601 */
+        asn1_time_str(tm, gt);
+        ASN1_TIME_free(tm);
+        if (strlen(gt)==TIME_SZ) {
+            sprintf(date, "%.4s-%.2s-%.2sT%.2s:%.2s:%.2sZ",
+                    gt, gt+4, gt+6, gt+8, gt+10, gt+12);
+        } else {
+            strcpy(date, gt);
+        }
+        ie = index_find_serial(hex);
+        if (!strcmp(out_format, "json")) {
+            printf("%s{\"serial\":\"%s\",\"revoked\":\"%s\",\"reason\":\"%s\",\"cn\":",
+                   n ? ",\n" : "", hex, date, crl_reasons[reason]);
+            if (ie)
+                put_quoted(stdout, ie->cn, 1);
+            else
+                printf("null");
+            printf("}");
+        } else {
+            printf("%s,%s,%s,", hex, date, crl_reasons[reason]);
+            if (ie)
+                put_quoted(stdout, ie->cn, 0);
+            printf("\n");
+        }
+        n++;
+    }
+    if (!strcmp(out_format, "json"))
+        printf("%s]\n", n ? "\n" : "");
+    fflush(stdout);
+    ASN1_TIME_free(epoch);
+    index_free();
+    if (ret<0) {
+        fprintf(stderr, "Cannot parse revoked entries in %s\n", filename);
+        return -1 ;
+    }
+    return n ;
+}
+
+/*
+ * openssl crl -in ca.crl -text
+ */
+void show_crl(char * ca_name)
+{
+    char filename[PATH_SZ];
+    const unsigned char * p ;
+    const unsigned char * q ;
+    ASN1_INTEGER * serial ;
+    ASN1_TIME * tm ;
+    crl_entry e ;
+    crl_der c ;
+    BIO * out ;
+    int reason ;
+    int ret ;
+
+    ca_file(ca_name, ".crl", filename);
+    if (access(filename, F_OK)!=0 || crl_der_load(filename, &c)!=0) {
+        printf("No CRL found\n");
+        return ;
+    }
+    if (out_format[0]) {
+        export_crl(&c, filename);
+        crl_der_free(&c);
+        return ;
+    }
+    out = BIO_new_fp(stdout, BIO_NOCLOSE);
+
+    /* Entries are decoded one at a time */
+    BIO_printf(out, "-- Revoked certificates found in CRL\n");
+    p = c.revoked ;
+    while ((ret=crl_der_next(&p, c.revoked+c.revoked_len, &e))==1) {
+        q = e.serial_der ;
+        serial = d2i_ASN1_INTEGER(NULL, &q, e.serial_der_len);
+        q = e.date ;
+        tm = d2i_ASN1_TIME(NULL, &q, e.date_len);
+        BIO_printf(out, "serial: ");
+        if (serial)
+            i2a_ASN1_INTEGER(out, serial);
+        BIO_printf(out, "\n  date: ");
+        if (tm)
+            ASN1_TIME_print(out, tm);
+        if ((reason=crl_entry_reason(&e))>0)
+            BIO_printf(out, "\nreason: %s", crl_reasons[reason]);
+        BIO_printf(out, "\n\n");
+        ASN1_INTEGER_free(serial);
+        ASN1_TIME_free(tm);
+    }
+    if (ret<0)
+        fprintf(stderr, "Cannot parse revoked entries in %s\n", filename);
+    crl_der_free(&c);
+    BIO_free_all(out);
+    return ;
+}
+
+/*
+ * Order certificates by serial number, as in a sorted CRL
+ */
+static int cert_serial_cmp(const void * a, const void * b)
+{
+    return ASN1_INTEGER_cmp(X509_get_serialNumber(*(X509 **)a),
+                            X509_get_serialNumber(*(X509 **)b));
+}
+
+/*
+ * Delta CRL: <ca>-delta.crl lists the certificates revoked since a base
+ * CRL, identified by its CRL number in the Delta CRL Indicator. It shares
+ * the CRL number of the full CRL issued at the same time. Without an
+ * existing delta, the full CRL before this update becomes the base.
+ */
+static int update_delta_crl(char * ca_name, identity * ca, ASN1_INTEGER * crlnum,
+                            ASN1_TIME * this_tm, ASN1_TIME * next_tm,
+                            ASN1_INTEGER * prev_num,
+                            X509 ** added, int n_added, int reason)
+{
+    char filename[PATH_SZ];
+    X509_CRL * delta ;
+    ASN1_INTEGER * base ;
+    int i, ret ;
+
+    ca_file(ca_name, "-delta.crl", filename);
+    if ((delta=load_crl_file(filename))!=NULL) {
+        base = X509_CRL_get_ext_d2i(delta, NID_delta_crl, 0, 0);
+    } else if (prev_num) {
+        delta = X509_CRL_new();
+        X509_CRL_set_version(delta, 1);
+        base = ASN1_INTEGER_dup(prev_num);
+    } else {
+        /* Brand new CRL: it is the base */
+        return 0 ;
+    }
+    if (!base) {
+        fprintf(stderr, "No base CRL number found in %s\n", filename);
+        X509_CRL_free(delta);
+        return -1 ;
+    }
+
+    X509_CRL_add1_ext_i2d(delta, NID_crl_number, crlnum, 0, X509V3_ADD_REPLACE);
+    X509_CRL_add1_ext_i2d(delta, NID_delta_crl, base, 1, X509V3_ADD_REPLACE);
+    ASN1_INTEGER_free(base);
+
+    for (i=0 ; i<n_added ; i++) {
+        X509_CRL_add0_revoked(delta, make_revoked(X509_get_serialNumber(added[i]), this_tm,
+                                                  reason));
+    }
+    X509_CRL_sort(delta);
+    X509_CRL_set_lastUpdate(delta, this_tm);
+    X509_CRL_set_nextUpdate(delta, next_tm);
+    X509_CRL_set_issuer_name(delta, X509_get_subject_name(ca->cert));
+    X509_CRL_sign(delta, ca->key, sign_md(ca->key));
+
+    ret = write_crl(delta, filename, "write_delta");
+    X509_CRL_free(delta);
+    return ret ;
+}
+
+/*
+ * CA state (CRL, delta CRL, revoked serials) is only changed with an
+ * exclusive lock on <ca>.lock, held for the whole update.
+ * Returns the locked descriptor, CA_LOCK_BUSY if the lock is held by
+ * someone else (wait=0), or -1 if it cannot be taken. Closing the
+ * descriptor releases the lock.
+ */
+#define CA_LOCK_BUSY    -2
+
+static int ca_lock(char * ca_name, int wait)
+{
+    char filename[PATH_SZ];
+    int fd, busy ;
+
+    ca_file(ca_name, ".lock", filename);
+    if ((fd=open(filename, O_RDWR|O_CREAT, 0644))<0 && errno==ENOENT &&
+        make_parents(filename)==0) {
+        fd = open(filename, O_RDWR|O_CREAT, 0644);
+    }
+    if (fd<0) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        return -1 ;
+    }
+    while (flock(fd, wait ? LOCK_EX : LOCK_EX|LOCK_NB)!=0) {
+        if (errno==EINTR)
+            continue ;
+        busy = errno==EWOULDBLOCK ;
+        close(fd);
+        if (busy)
+            return CA_LOCK_BUSY ;
+        fprintf(stderr, "Cannot lock %s\n", filename);
+        return -1 ;
+    }
+    return fd ;
+}
+
+/*
+ * Start a new base: re-issue the full CRL with the next CRL number and
+ * drop the delta CRL. The next revocation starts a new delta from there.
+ */
+int rebase_crl(char * ca_name)
+{
+    char filename[PATH_SZ];
+    unsigned char * serials ;
+    ASN1_INTEGER * crlnum ;
+    ASN1_INTEGER * prev ;
+    ASN1_TIME * tm ;
+    ASN1_TIME * next_tm ;
+    identity ca ;
+    crl_der c ;
+    int fd, ret, n=0, n_serials ;
+
+    if ((fd=ca_lock(ca_name, 1))<0)
+        return -1 ;
+    ca_file(ca_name, ".crl", filename);
+    if (access(filename, F_OK)!=0 || crl_der_load(filename, &c)!=0) {
+        printf("No CRL found\n");
+        close(fd);
+        return -1 ;
+    }
+    if (load_ca(ca_name, &ca)!=0) {
+        fprintf(stderr, "Cannot find CA key/crt\n");
+        crl_der_free(&c);
+        close(fd);
+        return -1 ;
+    }
+
+    /* Same entries, next CRL number */
+    tm = ASN1_TIME_new();
+    X509_gmtime_adj(tm, 0);
+    next_tm = ASN1_TIME_new();
+    X509_gmtime_adj(next_tm, 365*24*60*60);
+    ret = crl_der_update(&c, &ca, NULL, &n, 0, tm, next_tm, filename,
+                         &crlnum, &prev, &serials, &n_serials);
+    if (ret==0) {
+        printf("New base CRL written to %s\n", filename);
+        ca_file(ca_name, "-delta.crl", filename);
+        unlink(filename);
+        ASN1_INTEGER_free(crlnum);
+        ASN1_INTEGER_free(prev);
+        free(serials);
+    }
+    ASN1_TIME_free(tm);
+    ASN1_TIME_free(next_tm);
+    X509_free(ca.cert);
     EVP_PKEY_free(ca.key);
+    crl_der_free(&c);
+    close(fd);
+    return ret ;
+}
+
+/*
+ * Common Name of a certificate, as recorded in the index
+ */
+static char * cert_cn(X509 * cert, char * cn)
+{
+    cn[0] = 0 ;
+    X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_commonName,
+                              cn, FIELD_SZ);
+    return cn ;
+}
+
+#define JOURNAL_LINE    16384   /* reason and base64 DER certificate */
+
+/*
+ * Queue one revocation in <ca>.jnl for the next CRL update: a line with
+ * the reason code and the base64 DER certificate. Lines are appended in
+ * a single write under a shared lock on the journal itself. The writer
+ * renames the journal away, then locks it exclusively before reading,
+ * so that appends still going to the old file are complete.
+ */
+static int journal_add(char * ca_name, X509 * cert, int reason)
+{
+    char filename[PATH_SZ];
+    struct stat st_fd, st_path ;
+    unsigned char * der=NULL ;
+    char * line ;
+    int fd, len, n, ret=-1 ;
+
+    if ((len=i2d_X509(cert, &der))<=0)
+        return -1 ;
+    line = malloc(4*((len+2)/3) + 16);
+    n = sprintf(line, "%d ", reason);
+    n += EVP_EncodeBlock((unsigned char *)line+n, der, len);
+    line[n++] = '\n' ;
+    OPENSSL_free(der);
+
+    ca_file(ca_name, ".jnl", filename);
+    while (1) {
+        if ((fd=open(filename, O_WRONLY|O_APPEND|O_CREAT, 0644))<0) {
+            fprintf(stderr, "Cannot open %s\n", filename);
+            break ;
+        }
+        flock(fd, LOCK_SH);
+        /* Renamed away since it was opened: append to the new one */
+        if (fstat(fd, &st_fd)!=0 || stat(filename, &st_path)!=0 ||
+            st_fd.st_ino!=st_path.st_ino || st_fd.st_dev!=st_path.st_dev) {
+            close(fd);
+            continue ;
+        }
+        if (write(fd, line, n)==n && fsync(fd)==0) {
+            ret = 0 ;
+        } else {
+            fprintf(stderr, "Cannot update %s\n", filename);
+        }
+        close(fd);
+        break ;
+    }
+    free(line);
+    return ret ;
+}
+
+static int journal_pending(char * ca_name)
+{
+    char filename[PATH_SZ];
+    struct stat st ;
+
+    if (access(ca_file(ca_name, ".jnl.merge", filename), F_OK)==0)
+        return 1 ;
+    return stat(ca_file(ca_name, ".jnl", filename), &st)==0 && st.st_size>0 ;
+}
+
+/*
+ * With the CA lock held, move queued revocations to certs and reasons,
+ * which hold *n entries and have room for *sz. The journal stays in
+ * <ca>.jnl.merge until the CRL is written, to be merged again if the
+ * update fails. Returns the number of revocations taken.
+ */
+static int journal_take(char * ca_name, X509 *** certs, int ** reasons, int * n, int * sz)
+{
+    char filename[PATH_SZ];
+    char merge[PATH_SZ];
+    char line[JOURNAL_LINE];
+    unsigned char * der ;
+    const unsigned char * p ;
+    char * b64 ;
+    X509 * cert ;
+    FILE * f ;
+    int len, reason, taken=0 ;
+
+    ca_file(ca_name, ".jnl", filename);
+    ca_file(ca_name, ".jnl.merge", merge);
+    if (access(merge, F_OK)!=0 && rename(filename, merge)!=0)
+        return 0 ;
+    if ((f=fopen(merge, "r"))==NULL)
+        return 0 ;
+    /* Wait for appends still running on this file */
+    flock(fileno(f), LOCK_EX);
+    while (fgets(line, JOURNAL_LINE, f)) {
+        reason = (int)strtol(line, &b64, 10);
+        if (*b64++!=' ' || reason<0 || reason>=N_REASONS || !crl_reasons[reason]) {
+            fprintf(stderr, "Skipping bad line in %s\n", merge);
+            continue ;
+        }
+        b64[strcspn(b64, "\r\n")] = 0 ;
+        der = malloc(strlen(b64)/4*3 + 3);
+        len = EVP_DecodeBlock(der, (unsigned char *)b64, strlen(b64));
+        p = der ;
+        cert = len>0 ? d2i_X509(NULL, &p, len) : NULL ;
+        free(der);
+        if (!cert) {
+            fprintf(stderr, "Skipping bad line in %s\n", merge);
+            continue ;
+        }
+        if (*n+1>=*sz) {
+            *sz *= 2 ;
+            *certs   = realloc(*certs,   *sz * sizeof(X509 *));
+            *reasons = realloc(*reasons, *sz * sizeof(int));
+        }
+        (*certs)[*n]   = cert ;
+        (*reasons)[*n] = reason ;
+        (*n)++;
+        taken++;
+    }
+    fclose(f);
+    return taken ;
+}
+
+/*
+ * Revoke certificates already in memory with a single CRL update, all
+ * with the same reason code.
+ * Takes ownership of the certificates and of the added array, which
+ * must have room for one more entry. failed is the count of earlier
+ * failures to add to. Returns the number of failures, -1 on CRL errors.
+ */
+static int revoke_x509(char * ca_name, X509 ** added, int n_added, int reason, int failed,
+                       identity * signing_ca)
+{
+    char filename[PATH_SZ];
+    unsigned char bin[SERIAL_SZ];
+    unsigned char * serials = NULL ;
+    X509_CRL * crl ;
+    ASN1_INTEGER * crlnum = NULL ;
+    ASN1_INTEGER * prev_num = NULL ;
+    ASN1_TIME * tm ;
+    ASN1_TIME * next_tm ;
+    identity ca ;
+    crl_der c ;
+    char cn[FIELD_SZ+1];
+    int i, n, n_serials=0, have_crl ;
+    double t0=now_usec() ;
+
+    /* An existing CRL is only parsed, its entries are never decoded */
+    ca_file(ca_name, ".crl", filename);
+    have_crl = access(filename, F_OK)==0 && crl_der_load(filename, &c)==0 ;
+    /* Known serials are looked up in <ca>.rev */
+    ca_file(ca_name, ".rev", filename);
+    if (have_crl && access(filename, F_OK)!=0)
+        rebuild_serial_file(ca_name);
+    stats_stage("crl_load", t0, 0);
+
+    /* Find out which ones were already revoked */
+    for (i=0, n=0 ; i<n_added ; i++) {
+        if (have_crl && serial_to_bin(X509_get_serialNumber(added[i]), bin)==0 &&
+            serial_file_find(ca_name, bin)==1) {
+            fprintf(stderr, "Already revoked: %s\n", cert_cn(added[i], cn));
+            X509_free(added[i]);
+        } else {
+            added[n++] = added[i] ;
+        }
+    }
+    n_added = n ;
+
+    /* The same certificate may have been named twice */
+    qsort(added, n_added, sizeof(X509 *), cert_serial_cmp);
+    for (i=1, n=n_added>0 ? 1 : 0 ; i<n_added ; i++) {
+        if (!cert_serial_cmp(&added[i], &added[n-1])) {
+            X509_free(added[i]);
+        } else {
+            added[n++] = added[i] ;
+        }
+    }
+    n_added = n ;
+    if (n_added==0) {
+        /* Nothing new: leave the CRL untouched */
+        free(added);
+        if (have_crl)
+            crl_der_free(&c);
+        return failed ;
+    }
+
+    /* What time is it? Next update is a year from now */
+    tm = ASN1_TIME_new();
+    X509_gmtime_adj(tm, 0);
+    next_tm = ASN1_TIME_new();
+    X509_gmtime_adj(next_tm, 365*24*60*60);
+
+    /* Load root key to sign CRL */
+    if (signing_ca) {
+        ca = *signing_ca ;
+    } else if (load_ca(ca_name, &ca)!=0) {
+        fprintf(stderr, "Cannot find CA key/crt\n");
+        ca.cert = NULL ;
+        ca.key  = NULL ;
+        failed = -1 ;
+    }
+    ca_file(ca_name, ".crl", filename);
+    if (ca.cert && have_crl) {
+        /* Merge new entries into the existing CRL */
+        if (crl_der_update(&c, &ca, added, &n_added, reason, tm, next_tm, filename,
+                           &crlnum, &prev_num, &serials, &n_serials)!=0)
+            failed = -1 ;
+    } else if (ca.cert) {
+        /* Brand new CRL */
+        t0 = now_usec();
+        crl = X509_CRL_new();
+        X509_CRL_set_version(crl, 1);
+        ASN1_INTEGER_free(crl_next_number(crl));
+        serials = malloc(n_added * SERIAL_SZ);
+        for (i=0 ; i<n_added ; i++) {
+            X509_CRL_add0_revoked(crl, make_revoked(X509_get_serialNumber(added[i]), tm,
+                                                    reason));
+            if (serial_to_bin(X509_get_serialNumber(added[i]), serials+n_serials*SERIAL_SZ)==0)
+                n_serials++;
+        }
+        X509_CRL_sort(crl);
+        X509_CRL_set_lastUpdate(crl, tm);
+        X509_CRL_set_nextUpdate(crl, next_tm);
+        X509_CRL_set_issuer_name(crl, X509_get_subject_name(ca.cert));
+        X509_CRL_sign(crl, ca.key, sign_md(ca.key));
+        stats_stage("sign", t0, 0);
+        if (write_crl(crl, filename, "write_crl")!=0)
+            failed = -1 ;
+        crlnum = X509_CRL_get_ext_d2i(crl, NID_crl_number, 0, 0);
+        X509_CRL_free(crl);
+    }
+
+    /* Then the revoked serials and the delta CRL */
+    if (ca.cert && failed>=0 && n_added>0) {
+        if (write_serial_file(ca_name, serials, n_serials)!=0 ||
+            update_delta_crl(ca_name, &ca, crlnum, tm, next_tm, prev_num,
+                             added, n_added, reason)!=0) {
+            failed = -1 ;
+        } else {
+            t0 = now_usec();
+            for (i=0 ; i<n_added ; i++) {
+                index_append('R', added[i], tm, ca_name, cert_cn(added[i], cn));
+            }
+            stats_stage("write_index", t0, 0);
+        }
+    }
+    if (!signing_ca) {
+        X509_free(ca.cert);
+        EVP_PKEY_free(ca.key);
+    }
+    for (i=0 ; i<n_added ; i++) {
+        X509_free(added[i]);
+    }
+    if (have_crl)
+        crl_der_free(&c);
+    free(added);
+    free(serials);
+    ASN1_INTEGER_free(crlnum);
+    ASN1_INTEGER_free(prev_num);
+    ASN1_TIME_free(tm);
+    ASN1_TIME_free(next_tm);
+    return failed ;
+}
+
+/*
+ * With the CA lock held: revoke certs, possibly none, together with all
+ * queued revocations, in one CRL update per reason found. Takes
+ * ownership of certs, which has room for n+1 entries, and of reasons,
+ * the reason code of each of certs. reasons may be NULL when n is 0.
+ * Returns the number of failures added to failed, -1 on CRL errors.
+ */
+static int revoke_merge(char * ca_name, X509 ** certs, int * reasons, int n, int failed,
+                        identity * signing_ca)
+{
+    char filename[PATH_SZ];
+    X509 ** group ;
+    int i, k, r, ret, taken, sz=n+1, crl_error=0 ;
+
+    if (!reasons)
+        reasons = malloc(sz * sizeof(int));
+    if ((taken=journal_take(ca_name, &certs, &reasons, &n, &sz))>0)
+        printf("Merging %d queued revocations\n", taken);
+
+    for (r=0 ; r<N_REASONS ; r++) {
+        group = malloc((n+1) * sizeof(X509 *));
+        for (i=0, k=0 ; i<n ; i++) {
+            if (reasons[i]==r)
+                group[k++] = certs[i] ;
+        }
+        if (k==0) {
+            free(group);
+            continue ;
+        }
+        if ((ret=revoke_x509(ca_name, group, k, r, 0, signing_ca))<0) {
+            crl_error = 1 ;
+        } else {
+            failed += ret ;
+        }
+    }
+    if (taken>0 && !crl_error)
+        unlink(ca_file(ca_name, ".jnl.merge", filename));
+    free(certs);
+    free(reasons);
+    return crl_error ? -1 : failed ;
+}
+
+/*
+ * Revoke certs with the CA lock held in fd, see revoke_merge(), then
+ * release the lock. Revocations queued while it was held are merged as
+ * well: their authors found the lock busy and left them to us.
+ */
+static int revoke_update(char * ca_name, int fd, X509 ** certs, int * reasons, int n,
+                         int failed, identity * signing_ca)
+{
+    int ret ;
+
+    ret = revoke_merge(ca_name, certs, reasons, n, failed, signing_ca);
+    close(fd);
+    while (ret>=0 && journal_pending(ca_name) && (fd=ca_lock(ca_name, 0))>=0) {
+        if (revoke_merge(ca_name, malloc(sizeof(X509 *)), NULL, 0, 0, signing_ca)<0)
+            ret = -1 ;
+        close(fd);
+    }
+    return ret ;
+}
+
+/*
+ * Merge all queued revocations into the CRL now
+ */
+int merge_crl(char * ca_name)
+{
+    int fd ;
+
+    if ((fd=ca_lock(ca_name, 1))<0)
+        return -1 ;
+    return revoke_update(ca_name, fd, malloc(sizeof(X509 *)), NULL, 0, 0, NULL);
+}
+
+/*
+ * Revoke a list of certificates, identified by name, in a single CRL
+ * update: the CRL is loaded, sorted, signed and written only once.
+ * Certificates already found in the CRL are skipped, the others are
+ * revoked with reason.
+ * With queue=yes the certificates are queued in the CA journal, and the
+ * CRL is only updated here if no other process is doing it.
+ * If signing_ca is NULL the CA is loaded from ca_name.
+ * Returns the number of names that could not be revoked.
+ */
+static int revoke_crl(char * ca_name, char ** names, int n_names, int reason,
+                      identity * signing_ca)
+{
+    char filename[PATH_SZ];
+    FILE * f ;
+    X509 * cert ;
+    X509 ** added ;
+    int * reasons ;
+    int i, fd, n_added=0, failed=0 ;
+    double t0=now_usec() ;
+
+    /* Find requested certificates by name and collect their serials */
+    added = malloc((n_names+1) * sizeof(X509 *));
+    for (i=0 ; i<n_names ; i++) {
+        crt_file(ca_name, names[i], filename);
+        if ((f=fopen(filename, "r"))==NULL) {
+            fprintf(stderr, "Cannot find: %s\n", filename);
+            failed++;
+            continue ;
+        }
+        cert = PEM_read_X509(f, NULL, NULL, NULL);
+        fclose(f);
+        if (!cert) {
+            fprintf(stderr, "Cannot read: %s\n", filename);
+            failed++;
+            continue ;
+        }
+        added[n_added++] = cert ;
+    }
+    stats_stage("cert_read", t0, 0);
+
+    if (revoke_queue) {
+        for (i=0 ; i<n_added ; i++) {
+            if (journal_add(ca_name, added[i], reason)!=0)
+                failed++;
+            X509_free(added[i]);
+        }
+        if ((fd=ca_lock(ca_name, 0))==CA_LOCK_BUSY) {
+            printf("CRL busy, %d revocations queued\n", n_added);
+            free(added);
+            return failed ;
+        }
+        if (fd<0) {
+            fprintf(stderr, "Cannot update the CRL of %s\n", ca_name);
+            free(added);
+            return -1 ;
+        }
+        return revoke_update(ca_name, fd, added, NULL, 0, failed, signing_ca);
+    }
+    if ((fd=ca_lock(ca_name, 1))<0) {
+        for (i=0 ; i<n_added ; i++) {
+            X509_free(added[i]);
+        }
+        free(added);
+        return -1 ;
+    }
+    reasons = malloc((n_added+1) * sizeof(int));
+    for (i=0 ; i<n_added ; i++) {
+        reasons[i] = reason ;
+    }
+    return revoke_update(ca_name, fd, added, reasons, n_added, failed, signing_ca);
+}
+
+int revoke_certs(char * ca_name, char ** names, int n_names, int reason,
+                 identity * signing_ca)
+{
+    int ret ;
+
+    stats_begin("revoke", ca_name);
+    ret = revoke_crl(ca_name, names, n_names, reason, signing_ca);
+    stats_end(ret);
+    return ret ;
+}
+
+/*
+ * Revoke one certificate
+ */
+int revoke_cert(char * ca_name, char * name, int reason, identity * signing_ca)
+{
+    return revoke_certs(ca_name, &name, 1, reason, signing_ca);
+}
+
+/*
+ * Revoke all certificates named in a file, one name per line
+ */
+int revoke_list(char * ca_name, char * list_file, int reason)
+{
+    FILE * in ;
+    char   line[BATCH_LINE];
+    char * words[2];
+    char ** names ;
+    int i, n=0, sz=64, failed ;
+
+    if (!list_file || !strcmp(list_file, "-")) {
+        in = stdin ;
+    } else if ((in=fopen(list_file, "r"))==NULL) {
+        fprintf(stderr, "Cannot open: %s\n", list_file);
+        return -1 ;
+    }
+    names = malloc(sz * sizeof(char *));
+    while (fgets(line, BATCH_LINE, in)) {
+        if (split_line(line, words, 1)<1)
+            continue ;
+        if (n>=sz) {
+            sz *= 2 ;
+            names = realloc(names, sz * sizeof(char *));
+        }
+        names[n++] = strdup(words[0]);
+    }
+    if (in!=stdin)
+        fclose(in);
+
+    printf("Revoking %d certificates\n", n);
+    failed = n>0 ? revoke_certs(ca_name, names, n, reason, NULL) : 0 ;
+    for (i=0 ; i<n ; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return failed ;
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static BN_GENCB * BN_GENCB_new(void)
+{
+    return OPENSSL_malloc(sizeof(BN_GENCB));
+}
+
+static void BN_GENCB_free(BN_GENCB * cb)
+{
+    OPENSSL_free(cb);
+}
+#endif
+
+/*
+ * DH parameter search: every thread looks for a safe prime on its own,
+ * the first one to find it wins and the others are cancelled from their
+ * BN_GENCB callback. SIGINT cancels all of them.
+ */
+static struct {
+    pthread_mutex_t lock ;
+    DH * dh ;
+    int  bits ;
+    volatile sig_atomic_t done ;
+} dh_work = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 } ;
+
+static void dh_cancel(int sig)
+{
+    dh_work.done = 1 ;
+}
+
+static int dh_progress(int p, int n, BN_GENCB * cb)
+{
+    if (dh_work.done)
+        return 0 ;
+    progress(p, n, NULL);
+    return 1 ;
+}
+
+static void * dh_worker(void * arg)
+{
+    BN_GENCB * cb ;
+    DH * dh ;
+
+    cb = BN_GENCB_new();
+    BN_GENCB_set(cb, dh_progress, NULL);
+    dh = DH_new();
+    if (DH_generate_parameters_ex(dh, dh_work.bits, DH_GENERATOR_2, cb)) {
+        pthread_mutex_lock(&dh_work.lock);
+        if (!dh_work.dh) {
+            dh_work.dh = dh ;
+            dh = NULL ;
+        }
+        dh_work.done = 1 ;
+        pthread_mutex_unlock(&dh_work.lock);
+    }
+    DH_free(dh);
+    BN_GENCB_free(cb);
+    return NULL ;
+}
+
+static int write_dh(DH * dh, char * filename)
+{
+    BIO  * mem ;
+    long   bytes ;
+    double t0=now_usec() ;
+
+    mem = BIO_new(BIO_s_mem());
+    PEM_write_bio_DHparams(mem, dh);
+    bytes = write_bio(filename, mem, 0644);
+    BIO_free(mem);
+    if (bytes<0)
+        return -1 ;
+    stats_stage("write_dh", t0, bytes);
+    return 0 ;
+}
+
+/*
+ * Search DH parameters on n_threads threads at once, NULL if cancelled
+ */
+static DH * search_dh(int bits, int n_threads)
+{
+    pthread_t * threads ;
+    struct sigaction sa, old_sa ;
+    DH * dh ;
+    int i ;
+
+    if (n_threads<1)
+        n_threads = 1 ;
+    printf("Generating DH parameters (%d bits) on %d thread%s -- this can take long\n",
+           bits, n_threads, n_threads>1 ? "s" : "");
+    fflush(stdout);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dh_cancel ;
+    sigaction(SIGINT, &sa, &old_sa);
+
+    init_ssl_locks();
+    dh_work.dh   = NULL ;
+    dh_work.bits = bits ;
+    dh_work.done = 0 ;
+    threads = malloc(n_threads * sizeof(pthread_t));
+    for (i=0 ; i<n_threads ; i++) {
+        if (pthread_create(&threads[i], NULL, dh_worker, NULL)!=0)
+            break ;
+    }
+    n_threads = i ;
+    while (i-->0) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    sigaction(SIGINT, &old_sa, NULL);
+    fputc('\n', stderr);
+    dh = dh_work.dh ;
+    dh_work.dh = NULL ;
+    if (!dh)
+        fprintf(stderr, n_threads ? "Cancelled\n" : "Cannot start threads\n");
+    return dh ;
+}
+
+/*
+ * DH parameter pool, next to the key pool: POOL/dh-BITS/NAME.pem
+ * Parameters are claimed by renaming them, like keys.
+ */
+static void dhpool_path(int bits, char * path)
+{
+    sprintf(path, "%s/dh-%d", keypool_dir, bits);
+}
+
+static int dhpool_is_param(char * filename)
+{
+    size_t len = strlen(filename);
+    return filename[0]!='.' && len>4 && !strcmp(filename+len-4, ".pem");
+}
+
+static DH * dhpool_take(int bits)
+{
+    DIR * dir ;
+    struct dirent * de ;
+    char path[2*FIELD_SZ+1];
+    char src[4*FIELD_SZ+1];
+    char dst[4*FIELD_SZ+1];
+    DH * dh=NULL ;
+    FILE * f ;
+
+    dhpool_path(bits, path);
+    if ((dir=opendir(path))==NULL)
+        return NULL ;
+
+    sprintf(dst, "%s/.taken-%ld", path, (long)getpid());
+    while (!dh && (de=readdir(dir))!=NULL) {
+        if (!dhpool_is_param(de->d_name))
+            continue ;
+        sprintf(src, "%s/%s", path, de->d_name);
+        if (rename(src, dst)!=0)
+            continue ;
+        if ((f=fopen(dst, "r"))!=NULL) {
+            dh = PEM_read_DHparams(f, NULL, NULL, NULL);
+            fclose(f);
+        }
+        unlink(dst);
+    }
+    closedir(dir);
+    return dh ;
+}
+
+static int dhpool_count(int bits)
+{
+    DIR * dir ;
+    struct dirent * de ;
+    char path[2*FIELD_SZ+1];
+    int n=0 ;
+
+    dhpool_path(bits, path);
+    if ((dir=opendir(path))==NULL)
+        return 0 ;
+    while ((de=readdir(dir))!=NULL) {
+        if (dhpool_is_param(de->d_name))
+            n++;
+    }
+    closedir(dir);
+    return n ;
+}
+
+/*
+ * Top up the pool to count DH parameter sets of the given size
+ */
+int dhpool_fill(int bits, int count)
+{
+    char path[2*FIELD_SZ+1];
+    char filename[4*FIELD_SZ+1];
+    int i, n, ret ;
+    DH * dh ;
+
+    dhpool_path(bits, path);
+    if ((mkdir(keypool_dir, 0700)!=0 && access(keypool_dir, W_OK)!=0) ||
+        (mkdir(path, 0700)!=0 && access(path, W_OK)!=0)) {
+        fprintf(stderr, "Cannot create DH pool: %s\n", path);
+        return -1 ;
+    }
+    n = count - dhpool_count(bits);
+    if (n<=0) {
+        printf("DH pool %s already holds %d parameter sets\n", path, count);
+        return 0 ;
+    }
+    for (i=0 ; i<n ; i++) {
+        if ((dh=search_dh(bits, n_jobs))==NULL)
+            return -1 ;
+        sprintf(filename, "%s/%ld-%ld-%d.pem", path, (long)time(NULL), (long)getpid(), i);
+        ret = write_dh(dh, filename);
+        DH_free(dh);
+        if (ret!=0)
+            return -1 ;
+    }
+    printf("DH pool %s now holds %d parameter sets\n", path, dhpool_count(bits));
+    return 0 ;
+}
+
+/*
+ * Write dhBITS.pem, from the pool if it has parameters of that size,
+ * otherwise by searching on n_threads threads
+ */
+int generate_dhparam(int bits, int n_threads)
+{
+    char filename[FIELD_SZ+1];
+    DH * dh ;
+    double t0 ;
+    int ret ;
+
+    sprintf(filename, "dh%d.pem", bits);
+    stats_begin("dhparam", filename);
+    t0 = now_usec();
+    if ((dh=dhpool_take(bits))!=NULL) {
+        printf("Using pre-generated DH parameters from %s\n", keypool_dir);
+        stats_stage("dhpool", t0, 0);
+    } else {
+        if ((dh=search_dh(bits, n_threads))==NULL) {
+            stats_end(-1);
+            return -1 ;
+        }
+        stats_stage("dhgen", t0, 0);
+    }
+    ret = write_dh(dh, filename);
+    DH_free(dh);
+    stats_end(ret);
+    if (ret==0)
+        printf("done\n");
+    return ret ;
+}
+
+/*
+ * Write a well-known RFC 7919 group (ffdhe2048 ... ffdhe8192): instant
+ */
+int write_dh_group(char * group)
+{
+    char filename[FIELD_SZ+5];
+    DH * dh = NULL ;
+    int ret ;
+
+#ifdef NID_ffdhe2048
+    int nid = OBJ_sn2nid(group) ;
+
+    if (nid!=NID_undef)
+        dh = DH_new_by_nid(nid);
+#endif
+    if (!dh) {
+        fprintf(stderr, "Unknown DH group: %s\n", group);
+        return -1 ;
+    }
+    snprintf(filename, sizeof(filename), "%s.pem", group);
+    stats_begin("dhparam", filename);
+    ret = write_dh(dh, filename);
+    DH_free(dh);
+    stats_end(ret);
+    if (ret==0)
+        printf("Saved RFC 7919 group %s to %s\n", group, filename);
+    return ret ;
+}
+
+void usage(void)
+{
+    printf(
+        "\n"
+        "\tUse:\n"
+        "\t2cca root   [DN] [days=xx]         # Create a root CA\n"
+        "\t2cca sub    [DN] [days=xx] [ca=xx] # Create a sub CA\n"
+        "\t2cca server [DN] [days=xx] [ca=xx] # Create a server\n"
+        "\t2cca client [DN] [days=xx] [ca=xx] # Create a client\n"
+        "\t2cca www    [DN] [days=xx] [ca=xx] [dns=x] [dns=x]\n"
+        "\n"
+        "Where DN is given as key=val pairs. Supported fields:\n"
+        "\n"
+        "\tO     Organization, only for root (default: Home)\n"
+        "\tCN    Common Name (default: root|server|client\n"
+        "\tC     2-letter country code like US, FR, UK (optional)\n"
+        "\tST    a state name (optional)\n"
+        "\tL     a locality or city name (optional)\n"
+        "\temail an email address\n"
+        "\n"
+        "\tdays specifies certificate duration in days\n"
+        "\tp12=fast|strong|no sets PKCS#12 iterations for clients, or skips it\n"
+        "\n"
+        "Key generation:\n"
+        "\tEither RSA with keysize set by rsa=xx\n"
+        "\tOr elliptic-curve with curve name set by ec=xx (e.g. P-256, P-384)\n"
+        "\tOr Ed25519 with ec=ed25519\n"
+        "\tDefault is RSA-2048, i.e. rsa=2048\n"
+        "\tSigning CA is specified with ca=CN (default: root)\n"
+        "\tca=pkcs11:...;object=CN uses a CA key kept in a token (engine=ID, CCA_PIN)\n"
+        "\tprofiles=FILE adds or changes profiles: NAME EXTENSION VALUE per line\n"
+        "\n"
+        "CRL management\n"
+        "\t2cca crl [ca=xx]            # Show CRL for CA xx\n"
+        "\t2cca crl format=json|csv|bin [ca=xx] # Dump CRL entries in one pass\n"
+        "\t2cca revoke NAME [NAME...] [ca=xx] # Revoke certs by name\n"
+        "\t2cca revoke-list FILE [ca=xx]      # Revoke names listed in FILE\n"
+        "\t2cca crl-base [ca=xx]              # Start a new base for delta CRLs\n"
+        "\t2cca crl-merge [ca=xx]             # Merge revocations queued with queue=yes\n"
+        "\t2cca status NAME|serial=xx [ca=xx] # Revoked? exit 1 if so, 0 if not\n"
+        "\tqueue=yes on revoke queues names in a journal when the CRL is busy\n"
+        "\treason=xx on revoke sets the CRL reason, e.g. keyCompromise, superseded\n"
+        "\n"
+        "\t2cca dh [numbits] [jobs=N]  # Generate DH parameters on N threads\n"
+        "\t2cca dh ffdhe2048           # Write an RFC 7919 group (up to ffdhe8192)\n"
+        "\t2cca dh fill [bits=N] count=N [pool=DIR] # Pre-generate DH parameters\n"
+        "\n"
+        "Benchmarks\n"
+        "\t2cca bench [rsa=xx] [ec=xx] [count=N] # Time issuance and CRL stages\n"
+        "\tstats=json on any command prints per-stage timings on stderr\n"
+        "\n"
+        "Index of issued certificates\n"
+        "\t2cca list                   # List all certificates\n"
+        "\t2cca find NAME|serial=xx    # Find a certificate by CN or serial\n"
+        "\t2cca proof [NAME|serial=xx] # Prove a certificate is in the issuance log\n"
+        "\tstore=DIR on any command shards files per CA and CN hash in DIR\n"
+        "\n"
+        "Bulk issuance\n"
+        "\t2cca batch [FILE]           # One identity per line, - for stdin\n"
+        "\tEach line reads like a command line: TYPE [DN] [days=xx] [ca=xx]\n"
+        "\tjobs=N generates keys on N threads, jobs=0 uses all CPUs\n"
+        "\n"
+        "Signing requests\n"
+        "\t2cca sign csr=FILE|dir=DIR [profile=xx] [ca=xx] # Sign PKCS#10 requests\n"
+        "\tFILE may hold several PEM requests, - for stdin; DIR is scanned for *.csr\n"
+        "\tprofile is sub, server, client (default) or www\n"
+        "\n"
+        "Renewals\n"
+        "\t2cca renew [within=30d] [ca=xx] [days=xx] [jobs=N] [revoke=yes]\n"
+        "\tRe-issue certificates expiring within 30d, 12h or 6w, revoke=yes\n"
+        "\trevokes the previous ones as superseded in a single CRL update\n"
+        "\n"
+        "Issuance daemon\n"
+        "\t2cca serve [socket=PATH]    # Serve requests on a Unix socket\n"
+        "\tOne request per line, same syntax as batch lines, or\n"
+        "\trevoke NAME [NAME...] [ca=xx] [reason=xx], or stats.\n"
+        "\tReplies start with ok or error.\n"
+        "\n"
+        "OCSP responder\n"
+        "\t2cca ocsp [ca=xx] [port=N]  # Answer OCSP requests over HTTP\n"
+        "\n"
+        "Key pool\n"
+        "\t2cca keypool fill [rsa=xx|ec=xx] count=N [pool=DIR] # Top up pool\n"
+        "\t2cca keypool [rsa=xx|ec=xx] [pool=DIR]              # Count keys\n"
+        "\tKeys matching rsa=/ec= are taken from the pool when available\n"
+        "\n"
+        "Web server certificates\n"
+        "\tGenerate web server certificates using 'wwww'\n"
+        "\tSpecify DNS names using dns=x dns=y on the command-line\n"
+        "\n"
+    );
+}
+
+int parse_cmd_line(struct _certinfo_ * info, int argc, char ** argv)
+{
+    char key[FIELD_SZ+1] ;
+    char val[FIELD_SZ+1] ;
+    char tmp[FIELD_SZ+8] ;
+    int  ns=0 ;
+    char san[BIG_FIELD+1];
+    char * unit ;
+    int  i, j ;
+
+    memset(san, 0, BIG_FIELD+1);
+    for (i=2 ; i<argc ; i++) { 
+        if (sscanf(argv[i], "%128[^=]=%128s", key, val)==2) {
+            if (!strcmp(key, "rsa")) {
+                info->rsa_keysz = atoi(val);
+            } else if (!strcmp(key, "ec")) {
+                strcpy(info->ec_name, val);
+            } else if (!strcmp(key, "O")) {
+                strcpy(info->o, val);
+            } else if (!strcmp(key, "C")) {
+                strcpy(info->c, val);
+            } else if (!strcmp(key, "ST")) {
+                strcpy(info->st, val);
+            } else if (!strcmp(key, "CN")) {
+                strcpy(info->cn, val);
+            } else if (!strcmp(key, "L")) {
+                strcpy(info->l, val);
+            } else if (!strcmp(key, "email")) {
+                sprintf(tmp, "email:%s", val);
+                if (strlen(san)+strlen(tmp)+2>FIELD_SZ) {
+                    fprintf(stderr, "Too many alternative names: [%s]\n", val);
+                    return -1 ;
+                }
+                if (ns==0) {
+                    strcpy(san, tmp);
+                } else {
+                    strcat(san, ",\n");
+                    strcat(san, tmp);
+                }
+                ns++;
+            } else if (!strcmp(key, "dns")) {
+                sprintf(tmp, "DNS:%s", val);
+                if (strlen(san)+strlen(tmp)+2>FIELD_SZ) {
+                    fprintf(stderr, "Too many alternative names: [%s]\n", val);
+                    return -1 ;
+                }
+                if (ns==0) {
+                    strcpy(san, tmp);
+                } else {
+                    strcat(san, ",");
+                    strcat(san, tmp);
+                }
+                ns++;
+            } else if (!strcmp(key, "days")) {
+                info->days = atoi(val);
+                info->days_given = 1 ;
+            } else if (!strcmp(key, "within")) {
+                renew_within = strtol(val, &unit, 10);
+                if (!strcmp(unit, "h")) {
+                    renew_within *= 60*60 ;
+                } else if (!strcmp(unit, "w")) {
+                    renew_within *= 7*24*60*60 ;
+                } else if (!unit[0] || !strcmp(unit, "d")) {
+                    renew_within *= 24*60*60 ;
+                } else {
+                    fprintf(stderr, "Unsupported duration: [%s]\n", val);
+                    return -1 ;
+                }
+            } else if (!strcmp(key, "revoke")) {
+                renew_revoke = !strcmp(val, "yes") ;
+            } else if (!strcmp(key, "queue")) {
+                revoke_queue = !strcmp(val, "yes") ;
+            } else if (!strcmp(key, "ca")) {
+                if (!strncmp(val, KEY_URI, strlen(KEY_URI))) {
+                    if (key_uri_add(val, info->signing_ca)!=0)
+                        return -1 ;
+                } else {
+                    strcpy(info->signing_ca, val);
+                }
+            } else if (!strcmp(key, "engine")) {
+                strcpy(engine_id, val);
+            } else if (!strcmp(key, "count")) {
+                n_count = atoi(val);
+            } else if (!strcmp(key, "port")) {
+                ocsp_port = atoi(val);
+            } else if (!strcmp(key, "reason")) {
+                for (j=0 ; j<N_REASONS ; j++) {
+                    if (crl_reasons[j] && !strcasecmp(val, crl_reasons[j]))
+                        break ;
+                }
+                if (j==N_REASONS) {
+                    fprintf(stderr, "Unsupported reason: [%s]\n", val);
+                    return -1 ;
+                }
+                info->reason = j ;
+            } else if (!strcmp(key, "format")) {
+                if (strcmp(val, "json") && strcmp(val, "csv") && strcmp(val, "bin")) {
+                    fprintf(stderr, "Unsupported format: [%s]\n", val);
+                    return -1 ;
+                }
+                strcpy(out_format, val);
+            } else if (!strcmp(key, "store")) {
+                strcpy(store_dir, val);
+            } else if (!strcmp(key, "bits")) {
+                dh_bits = atoi(val);
+            } else if (!strcmp(key, "serial")) {
+                strcpy(find_serial, val);
+            } else if (!strcmp(key, "socket")) {
+                strcpy(serve_path, val);
+            } else if (!strcmp(key, "pool")) {
+                strcpy(keypool_dir, val);
+            } else if (!strcmp(key, "csr")) {
+                strcpy(csr_path, val);
+            } else if (!strcmp(key, "dir")) {
+                strcpy(csr_dir, val);
+            } else if (!strcmp(key, "profile")) {
+                strcpy(sign_profile, val);
+            } else if (!strcmp(key, "profiles")) {
+                if (profiles_load(val)!=0)
+                    return -1 ;
+            } else if (!strcmp(key, "p12")) {
+                if (!strcmp(val, "fast")) {
+                    p12_iter = P12_FAST_ITER ;
+                } else if (!strcmp(val, "strong")) {
+                    p12_iter = PKCS12_DEFAULT_ITER ;
+                } else if (!strcmp(val, "no")) {
+                    p12_iter = 0 ;
+                } else {
+                    fprintf(stderr, "Unsupported p12 option: [%s]\n", val);
+                    return -1 ;
+                }
+            } else if (!strcmp(key, "stats")) {
+                if (strcmp(val, "json")) {
+                    fprintf(stderr, "Unsupported stats format: [%s]\n", val);
+                    return -1 ;
+                }
+                stats_on = 1 ;
+            } else if (!strcmp(key, "jobs")) {
+                n_jobs = atoi(val);
+                if (n_jobs<1) {
+                    /* jobs=0: use all online CPUs */
+                    n_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+                    if (n_jobs<1)
+                        n_jobs=1 ;
+                }
+            } else {
+                fprintf(stderr, "Unsupported field: [%s]\n", key);
+                return -1 ;
+            }
+        }
+    }
+    if (ns>0) {
+        strcpy(info->san, san);
+        printf("SAN[%s]\n", info->san);
+    }
+    return 0 ;
+}
+
+/*
+ * Reset certificate fields to their default values
+ */
+static void certinfo_defaults(struct _certinfo_ * info)
+{
+    memset(info, 0, sizeof(struct _certinfo_));
+    info->rsa_keysz = RSA_KEYSZ ;
+    strcpy(info->o, "Home");
+    info->days = 3650 ;
+    strcpy(info->signing_ca, "root");
+}
+
+/*
+ * Map an identity command (root, sub, ...) to its profile
+ */
+static int set_profile(struct _certinfo_ * info, char * cmd)
+{
+    int i ;
+
+    for (i=PROFILE_ROOT_CA ; i<n_profiles ; i++) {
+        if (!strcmp(cmd, profiles[i].name)) {
+            info->profile = i<PROFILE_CUSTOM ? i : PROFILE_CUSTOM ;
+            info->custom  = i ;
+            return 0 ;
+        }
+    }
+    info->profile = PROFILE_UNKNOWN ;
+    return -1 ;
+}
+
+#define BATCH_WINDOW    64  /* lines read ahead per key generation round */
+
+/*
+ * One parsed batch line waiting for its key and signature
+ */
+typedef struct _batch_entry_ {
+    int    lineno ;
+    char * error ;
+    struct _certinfo_ info ;
+    int       pending ;     /* prepared, waiting for its signature */
+    issue_job job ;
+    op_state  stats ;
+} batch_entry ;
+
+/*
+ * Signatures for a batch window, shared by signing threads
+ */
+static struct {
+    pthread_mutex_t lock ;
+    batch_entry * entries ;
+    int  n ;
+    int  next ;
+} sign_work = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 } ;
+
+static void * sign_worker(void * arg)
+{
+    int slot = (int)(intptr_t)arg ;
+    issue_job * job ;
+    int i ;
+
+    while (1) {
+        pthread_mutex_lock(&sign_work.lock);
+        i = sign_work.next++ ;
+        pthread_mutex_unlock(&sign_work.lock);
+        if (i>=sign_work.n)
+            break ;
+        if (!sign_work.entries[i].pending)
+            continue ;
+        job = &sign_work.entries[i].job ;
+        issue_sign(job, job->signing_ca ? ca_signer(job->signing_ca, slot) : job->ca.key);
+    }
+    return NULL ;
+}
+
+/*
+ * Sign all prepared entries using up to n_threads threads. With a CA key
+ * in a token, each thread signs through its own session.
+ */
+static void sign_entries(batch_entry * entries, int n, int n_threads)
+{
+    pthread_t * tids ;
+    int i, started ;
+
+    sign_work.entries = entries ;
+    sign_work.n       = n ;
+    sign_work.next    = 0 ;
+
+    if (n_threads>n)
+        n_threads=n ;
+    if (n_threads>MAX_SIGNERS)
+        n_threads=MAX_SIGNERS ;
+    if (n_threads<=1) {
+        sign_worker((void*)0);
+        return ;
+    }
+    init_ssl_locks();
+    tids = malloc(n_threads * sizeof(pthread_t));
+    for (started=0 ; started<n_threads ; started++) {
+        if (pthread_create(&tids[started], NULL, sign_worker, (void*)(intptr_t)started)!=0)
+            break ;
+    }
+    if (started==0) {
+        /* No thread could be started: do it ourselves */
+        sign_worker((void*)0);
+    }
+    for (i=0 ; i<started ; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+}
+
+/*
+ * Fields a batch line or a daemon request may set: they only describe
+ * one certificate. Everything else configures the whole process and is
+ * only taken from the command line.
+ */
+static char * request_fields[] = {
+    "CN", "O", "C", "ST", "L", "email", "dns", "days", "ca", "rsa", "ec", "reason", NULL
+} ;
+
+/*
+ * Parse the key=val words of a request into info.
+ * Returns NULL if all are accepted, an error message otherwise.
+ */
+static char * parse_request_fields(struct _certinfo_ * info, int nw, char ** words)
+{
+    char key[FIELD_SZ+1];
+    char * val ;
+    int i, j ;
+
+    for (i=2 ; i<nw ; i++) {
+        if ((val=strchr(words[i], '='))==NULL)
+            continue ;
+        if (val-words[i]>FIELD_SZ || strlen(val+1)>FIELD_SZ) {
+            fprintf(stderr, "Field too long in a request: [%.32s]\n", words[i]);
+            return "field too long" ;
+        }
+        snprintf(key, sizeof(key), "%.*s", (int)(val-words[i]), words[i]);
+        for (j=0 ; request_fields[j] && strcmp(key, request_fields[j]) ; j++)
+            ;
+        if (!request_fields[j]) {
+            fprintf(stderr, "Field not allowed in a request: [%s]\n", key);
+            return "field not allowed in a request" ;
+        }
+        /* Token keys are only registered from the command line */
+        if (!strcmp(key, "ca") && !strncmp(val+1, KEY_URI, strlen(KEY_URI))) {
+            fprintf(stderr, "Key URI not allowed in a request: [%s]\n", val+1);
+            return "key URI not allowed in a request" ;
+        }
+        /* CN and ca= name files in the working directory */
+        if ((!strcmp(key, "CN") || !strcmp(key, "ca")) &&
+            (strchr(val+1, '/') || val[1]=='.')) {
+            fprintf(stderr, "Not a usable name in a request: [%s]\n", words[i]);
+            return "not a usable name" ;
+        }
+    }
+    if (parse_cmd_line(info, nw, words)!=0)
+        return "bad fields" ;
+    return NULL ;
+}
+
+/*
+ * Fill info from one request: words[1] is the identity type and
+ * the following words are key=val fields, as on the command line.
+ * Returns NULL if the request is valid, an error message otherwise.
+ */
+static char * parse_request(struct _certinfo_ * info, int nw, char ** words)
+{
+    char * error=NULL ;
+
+    certinfo_defaults(info);
+    if (set_profile(info, words[1])!=0) {
+        error = "unknown profile" ;
+    } else {
+        error = parse_request_fields(info, nw, words);
+    }
+    if (info->cn[0]==0) {
+        strcpy(info->cn, words[1]);
+    }
+    return error ;
+}
+
+/*
+ * True if entry is signed by a CA created by one of the n entries before
+ * it. The files of that CA only appear once their window is written.
+ */
+static int batch_needs_flush(batch_entry * entries, int n, batch_entry * entry)
+{
+    int i ;
+
+    for (i=0 ; i<n ; i++) {
+        if (!entries[i].error &&
+            (entries[i].info.profile==PROFILE_ROOT_CA ||
+             entries[i].info.profile==PROFILE_SUB_CA) &&
+            !strcmp(entries[i].info.cn, entry->info.signing_ca))
+            return 1 ;
+    }
+    return 0 ;
+}
+
+/*
+ * Read and parse up to max lines into entries and matching key jobs.
+ * A line signed by a CA created earlier in the window ends the window:
+ * it is kept in entries[*held] and becomes the first of the next one.
+ * Returns the number of entries filled, sets *eof at end of input.
+ */
+static int batch_read(FILE * in, int * lineno, batch_entry * entries,
+                      keyjob * kjobs, int max, int * held, int * eof)
+{
+    char   line[BATCH_LINE];
+    char * words[BATCH_WORDS+1];
+    int    nw, n=0 ;
+
+    if (*held) {
+        entries[0] = entries[*held] ;
+        kjobs[0]   = kjobs[*held] ;
+        *held = 0 ;
+        n = 1 ;
+    }
+    words[0] = "batch" ;
+    while (n<max) {
+        if (!fgets(line, BATCH_LINE, in)) {
+            *eof=1 ;
+            break ;
+        }
+        (*lineno)++;
+        if ((nw=split_line(line, words+1, BATCH_WORDS))<1)
+            continue ;
+
+        entries[n].lineno = *lineno ;
+        entries[n].error  = parse_request(&entries[n].info, nw+1, words);
+        kjobs[n].key = NULL ;
+        kjobs[n].rsa_keysz = entries[n].info.rsa_keysz ;
+        strcpy(kjobs[n].ec_name, entries[n].info.ec_name);
+        if (!entries[n].error && batch_needs_flush(entries, n, &entries[n])) {
+            *held = n ;
+            break ;
+        }
+        n++;
+    }
+    return n ;
+}
+
+/*
+ * Issue a window of parsed entries: serials are reserved, keys generated
+ * and files synced for the whole window at once. With n_jobs>1 keys are
+ * generated on n_jobs threads, and certificates signed by token keys are
+ * signed on n_jobs threads as well. Failures are reported in
+ * entries[i].error.
+ */
+static void issue_window(batch_entry * entries, keyjob * kjobs, int n)
+{
+    struct _certinfo_ * info ;
+    identity * ca ;
+    int i ;
+
+    /* Serials for the whole window at once */
+    serial_reserve(n);
+
+    if (n_jobs>1) {
+        for (i=0 ; i<n ; i++) {
+            if (entries[i].error) {
+                /* Do not waste time on a key for a bad line */
+                kjobs[i].rsa_keysz = 0 ;
+                kjobs[i].ec_name[0] = 0 ;
+            } else {
+                kjobs[i].key = keypool_take(kjobs[i].rsa_keysz, kjobs[i].ec_name);
+            }
+        }
+        printf("Generating %d keys on %d threads\n", n, n_jobs);
+        generate_keys(kjobs, n, n_jobs);
+    }
+
+    /* Files for the whole window are synced at once */
+    write_group_begin();
+    for (i=0 ; i<n ; i++) {
+        info = &entries[i].info ;
+        entries[i].pending = 0 ;
+        ca = NULL ;
+        if (!entries[i].error &&
+            info->profile!=PROFILE_ROOT_CA &&
+            (ca=get_ca(info->signing_ca))==NULL) {
+            entries[i].error = "cannot load signing CA" ;
+        }
+        if (entries[i].error) {
+            EVP_PKEY_free(kjobs[i].key);
+        } else if (n_jobs<=1 || !ca || !ca->key_uri) {
+            /* Software keys sign on this thread, in input order */
+            if (build_identity(info, ca, kjobs[i].key)!=0)
+                entries[i].error = "cannot issue identity" ;
+        } else {
+            /* Token key: signed below with the rest of the window */
+            stats_begin("issue", info->cn);
+            if (issue_prepare(&entries[i].job, info, ca, kjobs[i].key)!=0) {
+                stats_end(-1);
+                entries[i].error = "cannot issue identity" ;
+            } else {
+                entries[i].pending = 1 ;
+                stats_suspend(&entries[i].stats);
+            }
+        }
+    }
+    if (n_jobs>1) {
+        sign_entries(entries, n, n_jobs);
+        for (i=0 ; i<n ; i++) {
+            if (!entries[i].pending)
+                continue ;
+            stats_resume(&entries[i].stats);
+            if (issue_finish(&entries[i].job)!=0) {
+                stats_end(-1);
+                entries[i].error = "cannot issue identity" ;
+            } else {
+                stats_end(0);
+            }
+        }
+    }
+    if (write_group_end()!=0) {
+        fprintf(stderr, "Some files could not be written\n");
+        for (i=0 ; i<n ; i++) {
+            if (!entries[i].error && issue_published(&entries[i].info)!=0)
+                entries[i].error = "cannot write files" ;
+        }
+    }
+    log_flush();
+}
+
+/*
+ * Issue one identity per input line, e.g.
+ *   client CN=joe ca=VPNCA days=15
+ * Signing CAs are loaded once and reused for all lines. With jobs=N, keys
+ * for the next lines are generated on N threads, then signed and written
+ * in input order.
+ * Returns the number of lines that failed.
+ */
+int run_batch(char * batch_file)
+{
+    FILE * in ;
+    batch_entry * entries ;
+    keyjob * kjobs ;
+    int i, n, window, held=0, eof=0, lineno=0, ok=0, failed=0 ;
+
+    if (!batch_file || !strcmp(batch_file, "-")) {
+        in = stdin ;
+    } else if ((in=fopen(batch_file, "r"))==NULL) {
+        fprintf(stderr, "Cannot open batch file: %s\n", batch_file);
+        return -1 ;
+    }
+
+    window = n_jobs*4 > BATCH_WINDOW ? n_jobs*4 : BATCH_WINDOW ;
+    entries = calloc(window, sizeof(batch_entry));
+    kjobs   = calloc(window, sizeof(keyjob));
+
+    while (!eof) {
+        if ((n=batch_read(in, &lineno, entries, kjobs, window, &held, &eof))<1)
+            continue ;
+        issue_window(entries, kjobs, n);
+        for (i=0 ; i<n ; i++) {
+            if (entries[i].error) {
+                printf("line %d: [%s] failed: %s\n",
+                       entries[i].lineno, entries[i].info.cn, entries[i].error);
+                failed++;
+            } else {
+                printf("line %d: [%s] ok\n", entries[i].lineno, entries[i].info.cn);
+                ok++;
+            }
+            fflush(stdout);
+        }
+    }
+    if (in!=stdin)
+        fclose(in);
+    free(entries);
+    free(kjobs);
+    free_ca_cache();
+    printf("batch: %d issued, %d failed\n", ok, failed);
+    if (stats_on)
+        stats_summary(stderr);
+    return failed ;
+}
+
+/*
+ * Subject alternative names as a SAN config string, then released.
+ * Only DNS names and email addresses are carried over.
+ */
+static void names_to_san(GENERAL_NAMES * names, char * san)
+{
+    GENERAL_NAME * gn ;
+    char tmp[FIELD_SZ+1];
+    int i, ns=0 ;
+
+    san[0] = 0 ;
+    if (!names)
+        return ;
+    for (i=0 ; i<sk_GENERAL_NAME_num(names) ; i++) {
+        gn = sk_GENERAL_NAME_value(names, i);
+        if (gn->type==GEN_DNS) {
+            snprintf(tmp, sizeof(tmp), "DNS:%.*s", gn->d.dNSName->length,
+                     (char*)gn->d.dNSName->data);
+        } else if (gn->type==GEN_EMAIL) {
+            snprintf(tmp, sizeof(tmp), "email:%.*s", gn->d.rfc822Name->length,
+                     (char*)gn->d.rfc822Name->data);
+        } else {
+            continue ;
+        }
+        /* Names are plain ASCII, commas would split the config string */
+        if (strchr(tmp, ',') || strlen(san)+strlen(tmp)+1>FIELD_SZ)
+            continue ;
+        if (ns++)
+            strcat(san, ",");
+        strcat(san, tmp);
+    }
+    GENERAL_NAMES_free(names);
+}
+
+/*
+ * Subject alternative names requested in a CSR, see names_to_san()
+ */
+static void csr_san(X509_REQ * req, char * san)
+{
+    STACK_OF(X509_EXTENSION) * exts ;
+
+    san[0] = 0 ;
+    if ((exts=X509_REQ_get_extensions(req))==NULL)
+        return ;
+    names_to_san(X509V3_get_d2i(exts, NID_subject_alt_name, NULL, NULL), san);
+    sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+}
+
+/*
+ * Sign one PKCS#10 request with the profile in info. The subject is
+ * taken from the request, the rest from info. Only the certificate
+ * is written: the private key never leaves the requester.
+ */
+static int sign_request(struct _certinfo_ * info, X509_REQ * req, identity * ca)
+{
+    X509_NAME * subj ;
+    EVP_PKEY * pkey ;
+    X509 * cert ;
+    char filename[PATH_SZ];
+    BIO  * mem ;
+    long   bytes ;
+    double t0=now_usec() ;
+
+    need_algorithms(ALGS_DIGESTS);
+    if ((pkey=X509_REQ_get_pubkey(req))==NULL || X509_REQ_verify(req, pkey)!=1) {
+        fprintf(stderr, "Bad request signature\n");
+        EVP_PKEY_free(pkey);
+        return -1 ;
+    }
+    stats_stage("csr_verify", t0, 0);
+
+    subj = X509_REQ_get_subject_name(req);
+    if (X509_NAME_get_text_by_NID(subj, NID_commonName, info->cn, FIELD_SZ)<1 ||
+        strchr(info->cn, '/') || info->cn[0]=='.') {
+        fprintf(stderr, "Request has no usable CN\n");
+        EVP_PKEY_free(pkey);
+        return -1 ;
+    }
+    if (X509_NAME_get_text_by_NID(subj, NID_countryName, info->c, FIELD_SZ)<0)
+        info->c[0] = 0 ;
+    if (X509_NAME_get_text_by_NID(subj, NID_stateOrProvinceName, info->st, FIELD_SZ)<0)
+        info->st[0] = 0 ;
+    if (X509_NAME_get_text_by_NID(subj, NID_localityName, info->l, FIELD_SZ)<0)
+        info->l[0] = 0 ;
+    /* dns= on the command line wins over names in the request */
+    if (!info->san[0])
+        csr_san(req, info->san);
+    X509_NAME_get_text_by_NID(X509_get_subject_name(ca->cert), NID_organizationName,
+                              info->o, FIELD_SZ);
+    strcpy(info->ou, profile_of(info)->ou);
+
+    if (claim_file(identity_file(info, ".crt", filename))!=0) {
+        fprintf(stderr, "identity named %s already exists\n", filename);
+        EVP_PKEY_free(pkey);
+        return -1 ;
+    }
+    if ((cert=make_cert(info, ca->cert, pkey))==NULL) {
+        unclaim_file(filename);
+        EVP_PKEY_free(pkey);
+        return -1 ;
+    }
+    EVP_PKEY_free(pkey);
+    t0 = now_usec();
+    if (X509_sign(cert, ca->key, sign_md(ca->key))<=0) {
+        fprintf(stderr, "Cannot sign certificate for %s\n", info->cn);
+        unclaim_file(filename);
+        X509_free(cert);
+        return -1 ;
+    }
+    stats_stage("sign", t0, 0);
+
+    t0 = now_usec();
+    mem = out_buffer();
+    PEM_write_bio_X509(mem, cert);
+    bytes = identity_write(info, filename, mem, 0644);
+    stats_stage("write_crt", t0, bytes);
+    unclaim_file(filename);
+    if (bytes>=0) {
+        t0 = now_usec();
+        log_issue(cert, info->signing_ca, info->cn);
+        stats_stage("write_index", t0, 0);
+    }
+    X509_free(cert);
+    return bytes<0 ? -1 : 0 ;
+}
+
+/*
+ * Sign all requests read from one PEM stream, syncing files in groups.
+ * Adds to *ok and *failed.
+ */
+static void sign_stream(FILE * in, char * source, identity * ca,
+                        struct _certinfo_ * base, int * ok, int * failed)
+{
+    struct _certinfo_ infos[BATCH_WINDOW];
+    X509_REQ * reqs[BATCH_WINDOW];
+    int  ret[BATCH_WINDOW];
+    int  i, n, total=0, eof=0 ;
+
+    while (!eof) {
+        for (n=0 ; n<BATCH_WINDOW ; n++) {
+            if ((reqs[n]=PEM_read_X509_REQ(in, NULL, NULL, NULL))==NULL) {
+                eof = 1 ;
+                break ;
+            }
+        }
+        /* PEM reader errors at end of input are expected */
+        ERR_clear_error();
+        if (n==0)
+            break ;
+        total += n ;
+        serial_reserve(n);
+        write_group_begin();
+        for (i=0 ; i<n ; i++) {
+            infos[i] = *base ;
+            stats_begin("sign", source);
+            ret[i] = sign_request(&infos[i], reqs[i], ca);
+            stats_end(ret[i]);
+            X509_REQ_free(reqs[i]);
+        }
+        if (write_group_end()!=0) {
+            fprintf(stderr, "Some files could not be written\n");
+            for (i=0 ; i<n ; i++) {
+                if (ret[i]==0)
+                    ret[i] = issue_published(&infos[i]);
+            }
+        }
+        log_flush();
+        for (i=0 ; i<n ; i++) {
+            if (ret[i]==0) {
+                printf("%s: [%s] ok\n", source, infos[i].cn);
+                (*ok)++;
+            } else {
+                printf("%s: [%s] failed\n", source, infos[i].cn[0] ? infos[i].cn : "?");
+                (*failed)++;
+            }
+        }
+        fflush(stdout);
+    }
+    if (total==0) {
+        printf("%s: failed: no request found\n", source);
+        (*failed)++;
+    }
+}
+
+/*
+ * Sign certificate requests from csr=FILE or every *.csr file in dir=DIR,
+ * loading the signing CA only once. Returns the number of failures.
+ */
+int run_sign(void)
+{
+    struct _certinfo_ base ;
+    struct dirent * de ;
+    identity * ca ;
+    DIR  * d ;
+    FILE * in ;
+    char filename[PATH_SZ];
+    size_t len ;
+    int ok=0, failed=0 ;
+
+    if (!csr_path[0] && !csr_dir[0]) {
+        fprintf(stderr, "Use: 2cca sign csr=FILE|dir=DIR [profile=xx] [ca=xx]\n");
+        return -1 ;
+    }
+    base = certinfo ;
+    if (set_profile(&base, sign_profile)!=0 || base.profile==PROFILE_ROOT_CA) {
+        fprintf(stderr, "Unsupported profile for signing: [%s]\n", sign_profile);
+        return -1 ;
+    }
+    if ((ca=get_ca(base.signing_ca))==NULL) {
+        return -1 ;
+    }
+    if (csr_path[0]) {
+        if (!strcmp(csr_path, "-")) {
+            sign_stream(stdin, "stdin", ca, &base, &ok, &failed);
+        } else if ((in=fopen(csr_path, "r"))==NULL) {
+            fprintf(stderr, "Cannot open: %s\n", csr_path);
+            failed++;
+        } else {
+            sign_stream(in, csr_path, ca, &base, &ok, &failed);
+            fclose(in);
+        }
+    }
+    if (csr_dir[0]) {
+        if ((d=opendir(csr_dir))==NULL) {
+            fprintf(stderr, "Cannot open directory: %s\n", csr_dir);
+            failed++;
+        } else {
+            while ((de=readdir(d))!=NULL) {
+                len = strlen(de->d_name);
+                if (len<5 || strcmp(de->d_name+len-4, ".csr"))
+                    continue ;
+                snprintf(filename, sizeof(filename), "%s/%s", csr_dir, de->d_name);
+                if ((in=fopen(filename, "r"))==NULL) {
+                    fprintf(stderr, "Cannot open: %s\n", filename);
+                    failed++;
+                    continue ;
+                }
+                sign_stream(in, de->d_name, ca, &base, &ok, &failed);
+                fclose(in);
+            }
+            closedir(d);
+        }
+    }
+    free_ca_cache();
+    printf("sign: %d signed, %d failed\n", ok, failed);
+    if (stats_on)
+        stats_summary(stderr);
+    return failed ;
+}
+
+/*
+ * Profile an existing leaf certificate was issued with: same OU and
+ * same extended key usage. Certificates from older versions carry no
+ * extended key usage at all: they match on OU alone, so that Server
+ * renews as server and Client as client.
+ * Returns its index in profiles[] or -1.
+ */
+static int renew_profile(X509 * old, int rsa)
+{
+    STACK_OF(X509_EXTENSION) * exts ;
+    X509_EXTENSION * ext ;
+    ASN1_OCTET_STRING * eku=NULL ;
+    char ou[FIELD_SZ+1];
+    int i, j ;
+
+    if (X509_NAME_get_text_by_NID(X509_get_subject_name(old),
+                                  NID_organizationalUnitName, ou, FIELD_SZ)<0)
+        ou[0] = 0 ;
+    if ((i=X509_get_ext_by_NID(old, NID_ext_key_usage, -1))>=0)
+        eku = X509_EXTENSION_get_data(X509_get_ext(old, i));
+
+    for (i=PROFILE_SERVER ; i<n_profiles ; i++) {
+        if (strcmp(ou, profiles[i].ou))
+            continue ;
+        if (!eku)
+            return i ;
+        exts = profile_exts(&profiles[i], rsa);
+        for (j=0 ; j<sk_X509_EXTENSION_num(exts) ; j++) {
+            ext = sk_X509_EXTENSION_value(exts, j);
+            if (OBJ_obj2nid(X509_EXTENSION_get_object(ext))==NID_ext_key_usage)
+                break ;
+        }
+        if (j<sk_X509_EXTENSION_num(exts) &&
+            !ASN1_STRING_cmp(eku, X509_EXTENSION_get_data(ext)))
+            return i ;
+    }
+    return -1 ;
+}
+
+/*
+ * Describe in info the renewal of an indexed certificate: same
+ * subject, names, profile, key type and validity unless days= was given.
+ * The previous certificate is returned in *old.
+ * Returns NULL if it can be renewed, an error message otherwise.
+ */
+static char * renew_info(struct _certinfo_ * info, idx_entry * e, X509 ** old)
+{
+    char filename[PATH_SZ];
+    char serial[SERIAL_HEX+1];
+    X509_NAME * subj ;
+    EVP_PKEY * pub ;
+    EC_KEY * ecc ;
+    FILE * f ;
+    const char * curve ;
+    int i, day, sec ;
+
+    *old = NULL ;
+    if ((f=fopen(crt_file(e->issuer, e->cn, filename), "r"))==NULL)
+        return "certificate file not found" ;
+    *old = PEM_read_X509(f, NULL, NULL, NULL);
+    fclose(f);
+    if (*old==NULL)
+        return "cannot read certificate" ;
+    serial_str(X509_get_serialNumber(*old), serial);
+    if (strcmp(serial, e->serial))
+        return "certificate file does not match the index" ;
+    if (X509_check_ca(*old)>0)
+        return "CA certificates are not renewed" ;
+    if ((pub=X509_get_pubkey(*old))==NULL)
+        return "cannot read public key" ;
+
+    /* Same key type and size */
+    info->ec_name[0] = 0 ;
+    switch (EVP_PKEY_base_id(pub)) {
+        case EVP_PKEY_RSA:
+            info->rsa_keysz = EVP_PKEY_bits(pub);
+            break ;
+        case EVP_PKEY_EC:
+            ecc = EVP_PKEY_get1_EC_KEY(pub);
+            i = EC_GROUP_get_curve_name(EC_KEY_get0_group(ecc));
+            if ((curve=EC_curve_nid2nist(i))==NULL)
+                curve = OBJ_nid2sn(i);
+            snprintf(info->ec_name, FIELD_SZ+1, "%s", curve);
+            EC_KEY_free(ecc);
+            break ;
+#ifdef NID_ED25519
+        case NID_ED25519:
+            strcpy(info->ec_name, "ed25519");
+            break ;
+#endif
+        default:
+            EVP_PKEY_free(pub);
+            return "unsupported key type" ;
+    }
+    i = renew_profile(*old, EVP_PKEY_base_id(pub)==EVP_PKEY_RSA);
+    EVP_PKEY_free(pub);
+    if (i<0 || set_profile(info, profiles[i].name)!=0)
+        return "unknown profile" ;
+
+    /* Same subject and names, O and OU come from the CA and profile */
+    subj = X509_get_subject_name(*old);
+    strcpy(info->cn, e->cn);
+    if (X509_NAME_get_text_by_NID(subj, NID_countryName, info->c, FIELD_SZ)<0)
+        info->c[0] = 0 ;
+    if (X509_NAME_get_text_by_NID(subj, NID_stateOrProvinceName, info->st, FIELD_SZ)<0)
+        info->st[0] = 0 ;
+    if (X509_NAME_get_text_by_NID(subj, NID_localityName, info->l, FIELD_SZ)<0)
+        info->l[0] = 0 ;
+    names_to_san(X509_get_ext_d2i(*old, NID_subject_alt_name, NULL, NULL), info->san);
+    if (!info->days_given &&
+        ASN1_TIME_diff(&day, &sec, X509_get_notBefore(*old), X509_get_notAfter(*old))) {
+        info->days = day>0 ? day : 1 ;
+    }
+    strcpy(info->signing_ca, e->issuer);
+
+    /* Signed requests have no key here: the requester must send a new one */
+    if (!file_exists(identity_file(info, ".key", filename)))
+        return "no private key, sign a new request" ;
+    info->replace = 1 ;
+    return NULL ;
+}
+
+/*
+ * Re-issue all valid certificates signed by ca_name that expire within
+ * renew_within seconds, in windows of parallel key generation and
+ * signatures as for batch. With revoke=yes the previous certificates are
+ * then revoked as superseded in a single CRL update.
+ * Returns the number of certificates that could not be renewed.
+ */
+int run_renew(char * ca_name)
+{
+    batch_entry * entries ;
+    keyjob * kjobs ;
+    idx_entry * due ;
+    X509 ** olds ;
+    X509 ** superseded ;
+    ASN1_TIME * tm ;
+    idx_entry * e ;
+    char limit[TIME_SZ+1];
+    int * reasons ;
+    int i, j, n, n_due=0, n_superseded=0, window, ok=0, failed=0 ;
+
+    /* Index times are all YYYYMMDDHHMMSSZ: compare as strings */
+    tm = ASN1_TIME_new();
+    X509_gmtime_adj(tm, renew_within);
+    asn1_time_str(tm, limit);
+    ASN1_TIME_free(tm);
+
+    n = index_load();
+    due = malloc((n+1) * sizeof(idx_entry));
+    for (i=0 ; i<n ; i++) {
+        e = &cert_index.entries[i] ;
+        if (e->status=='V' && !strcmp(e->issuer, ca_name) &&
+            strcmp(e->not_after, limit)<=0 &&
+            index_find_issued(ca_name, e->cn)==e) {
+            due[n_due++] = *e ;
+        }
+    }
+    printf("renew: %d certificates from %s expire before %s\n", n_due, ca_name, limit);
+
+    window = n_jobs*4 > BATCH_WINDOW ? n_jobs*4 : BATCH_WINDOW ;
+    entries    = calloc(window, sizeof(batch_entry));
+    kjobs      = calloc(window, sizeof(keyjob));
+    olds       = calloc(window, sizeof(X509 *));
+    superseded = malloc((n_due+1) * sizeof(X509 *));
+
+    for (i=0 ; i<n_due ; i+=n) {
+        n = n_due-i<window ? n_due-i : window ;
+        for (j=0 ; j<n ; j++) {
+            entries[j].lineno = i+j+1 ;
+            entries[j].info   = certinfo ;
+            entries[j].error  = renew_info(&entries[j].info, &due[i+j], &olds[j]);
+            kjobs[j].key = NULL ;
+            kjobs[j].rsa_keysz = entries[j].info.rsa_keysz ;
+            strcpy(kjobs[j].ec_name, entries[j].info.ec_name);
+        }
+        issue_window(entries, kjobs, n);
+        for (j=0 ; j<n ; j++) {
+            if (entries[j].error) {
+                printf("renew: [%s] failed: %s\n", due[i+j].cn, entries[j].error);
+                X509_free(olds[j]);
+                failed++;
+            } else {
+                printf("renew: [%s] ok\n", due[i+j].cn);
+                if (renew_revoke) {
+                    superseded[n_superseded++] = olds[j] ;
+                } else {
+                    X509_free(olds[j]);
+                }
+                ok++;
+            }
+            fflush(stdout);
+        }
+    }
+    free(due);
+    free(entries);
+    free(kjobs);
+    free(olds);
+
+    /* Previous certificates go to the CRL all at once */
+    if (n_superseded>0) {
+        if ((j=ca_lock(ca_name, 1))<0) {
+            n = -1 ;
+            for (i=0 ; i<n_superseded ; i++) {
+                X509_free(superseded[i]);
+            }
+            free(superseded);
+        } else {
+            reasons = malloc((n_superseded+1) * sizeof(int));
+            for (i=0 ; i<n_superseded ; i++) {
+                /* superseded unless reason= was given */
+                reasons[i] = certinfo.reason ? certinfo.reason : CRL_REASON_SUPERSEDED ;
+            }
+            n = revoke_update(ca_name, j, superseded, reasons, n_superseded, 0,
+                              get_ca(ca_name));
+        }
+        if (n!=0) {
+            fprintf(stderr, "Cannot revoke all renewed certificates\n");
+            failed += n>0 ? n : 1 ;
+        }
+    } else {
+        free(superseded);
+    }
+    free_ca_cache();
+    printf("renew: %d renewed, %d failed\n", ok, failed);
+    if (stats_on)
+        stats_summary(stderr);
+    return failed ;
+}
+
+#define SERVE_SOCKET    "2cca.sock"
+
+static volatile sig_atomic_t serving ;
+
+static void serve_stop(int sig)
+{
+    serving = 0 ;
+}
+
+/*
+ * Handle one request line received by the daemon, write the reply to out
+ */
+static void serve_request(char * line, FILE * out)
+{
+    struct _certinfo_ info ;
+    char * words[BATCH_WORDS+1];
+    char   ca_name[FIELD_SZ+1];
+    char * error ;
+    identity * ca ;
+    int nw, i, n, failed ;
+
+    words[0] = "serve" ;
+    if ((nw=split_line(line, words+1, BATCH_WORDS))<1) {
+        fprintf(out, "error empty request\n");
+        return ;
+    }
+    if (!strcmp(words[1], "stats")) {
+        if (!stats_on) {
+            fprintf(out, "error stats are disabled\n");
+        } else {
+            fprintf(out, "ok ");
+            stats_summary(out);
+        }
+        return ;
+    }
+    if (!strcmp(words[1], "revoke")) {
+        /* revoke NAME [NAME...] [ca=xx] [reason=xx] */
+        certinfo_defaults(&info);
+        if ((error=parse_request_fields(&info, nw+1, words))!=NULL) {
+            fprintf(out, "error %s\n", error);
+            return ;
+        }
+        for (i=2, n=0 ; i<=nw ; i++) {
+            if (!strchr(words[i], '='))
+                words[2+n++] = words[i] ;
+        }
+        if (n==0) {
+            fprintf(out, "error usage: revoke NAME [NAME...] [ca=xx]\n");
+            return ;
+        }
+        strcpy(ca_name, info.signing_ca);
+        if ((ca=get_ca(ca_name))==NULL) {
+            fprintf(out, "error cannot load CA %s\n", ca_name);
+        } else if ((failed=revoke_certs(ca_name, words+2, n, info.reason, ca))!=0) {
+            fprintf(out, "error %d of %d not revoked\n", failed<0 ? n : failed, n);
+        } else {
+            fprintf(out, "ok %d revoked\n", n);
+        }
+        return ;
+    }
+
+    if ((error=parse_request(&info, nw+1, words))!=NULL) {
+        fprintf(out, "error %s\n", error);
+        return ;
+    }
+    ca = NULL ;
+    if (info.profile!=PROFILE_ROOT_CA &&
+        (ca=get_ca(info.signing_ca))==NULL) {
+        fprintf(out, "error cannot load CA %s\n", info.signing_ca);
+    } else if (build_identity(&info, ca, NULL)!=0) {
+        fprintf(out, "error cannot issue %s\n", info.cn);
+    } else {
+        fprintf(out, "ok %s\n", info.cn);
+    }
+}
+
+/*
+ * Issuance daemon: accept connections on a Unix socket and handle one
+ * request per line, using the same syntax as batch files:
+ *   client CN=joe ca=VPNCA      -> ok joe
+ *   revoke joe ca=VPNCA         -> ok joe
+ *   stats                       -> ok {"op":"summary",...}
+ * Replies are a single line starting with ok or error.
+ * Signing CAs are loaded on first use and kept in memory.
+ */
+int run_server(char * path)
+{
+    struct sockaddr_un addr ;
+    struct sigaction   sa ;
+    char   line[BATCH_LINE];
+    int    sock, fd, rc ;
+    mode_t mask ;
+    FILE * in ;
+    FILE * out ;
+
+    if (strlen(path)>=sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1 ;
+    }
+    if ((sock=socket(AF_UNIX, SOCK_STREAM, 0))<0) {
+        perror("socket");
+        return -1 ;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX ;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    /* Only the owner may talk to the CA */
+    mask = umask(077);
+    rc = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rc!=0 || listen(sock, 16)!=0) {
+        perror(path);
+        close(sock);
+        return -1 ;
+    }
+
+    /* Stop cleanly on INT or TERM, keep going if a client goes away */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_stop ;
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Listening on %s\n", path);
+    fflush(stdout);
+    serving = 1 ;
+    while (serving) {
+        if ((fd=accept(sock, NULL, NULL))<0)
+            continue ;
+        in  = fdopen(fd, "r");
+        out = fdopen(dup(fd), "w");
+        if (!in || !out) {
+            if (in) fclose(in); else close(fd);
+            if (out) fclose(out);
+            continue ;
+        }
+        while (serving && fgets(line, BATCH_LINE, in)) {
+            if (!strncmp(line, "quit", 4))
+                break ;
+            serve_request(line, out);
+            fflush(out);
+            fflush(stdout);
+        }
+        fclose(in);
+        fclose(out);
+    }
+    close(sock);
+    unlink(path);
+    free_ca_cache();
+    printf("Server stopped\n");
+    return 0 ;
+}
+
+/*
+ * OCSP responder
+ * Responses are signed once per certificate and kept in memory as DER,
+ * until they expire or the CRL changes. Cached responses carry no nonce,
+ * as in the lightweight OCSP profile (RFC 5019), so that answering a
+ * known certificate is only a lookup and a copy.
+ * Only certificates found in the index as issued by this CA are cached,
+ * at most OCSP_BUCKET_MAX per bucket: other requests are answered but
+ * cannot make the cache grow.
+ */
+#define OCSP_PORT       2560
+#define OCSP_VALIDITY   (24*60*60)  /* lifetime of a signed response */
+#define OCSP_BUCKETS    4096
+#define OCSP_BUCKET_MAX 16
+#define OCSP_MAX_REQ    16384
+
+typedef struct _ocsp_cached_ {
+    unsigned char * id ;    /* DER-encoded CertID */
+    int             id_len ;
+    unsigned char * der ;   /* DER-encoded signed response */
+    int             der_len ;
+    time_t          expires ;
+    struct _ocsp_cached_ * next ;
+} ocsp_cached ;
+
+static struct {
+    ocsp_cached * buckets[OCSP_BUCKETS] ;
+    crl_der       crl ;
+    time_t        crl_mtime ;
+    ino_t         crl_ino ;
+    off_t         crl_size ;
+} ocsp_state ;
+
+static unsigned int ocsp_hash(unsigned char * id, int len)
+{
+    unsigned int h=2166136261u ;
+    int i ;
+
+    for (i=0 ; i<len ; i++) {
+        h = (h ^ id[i]) * 16777619u ;
+    }
+    return h % OCSP_BUCKETS ;
+}
+
+static void ocsp_cached_free(ocsp_cached * c)
+{
+    OPENSSL_free(c->id);
+    OPENSSL_free(c->der);
+    free(c);
+}
+
+/*
+ * Make room for one more response in bucket h: expired responses go
+ * first, then the oldest ones.
+ */
+static void ocsp_trim(unsigned int h)
+{
+    ocsp_cached ** p ;
+    ocsp_cached * c ;
+    time_t now=time(NULL) ;
+    int n=0 ;
+
+    for (p=&ocsp_state.buckets[h] ; (c=*p)!=NULL ; ) {
+        if (c->expires<=now+60 || n>=OCSP_BUCKET_MAX-1) {
+            *p = c->next ;
+            ocsp_cached_free(c);
+        } else {
+            p = &c->next ;
+            n++;
+        }
+    }
+}
+
+/*
+ * True if cid is a certificate this CA issued, according to the index
+ */
+static int ocsp_known(OCSP_CERTID * cid, char * ca_name, identity * ca)
+{
+    char hex[SERIAL_HEX+1];
+    ASN1_OBJECT * md_oid ;
+    ASN1_INTEGER * serial ;
+    OCSP_CERTID * ca_id ;
+    const EVP_MD * md ;
+    idx_entry * e ;
+    int ours ;
+
+    OCSP_id_get0_info(NULL, &md_oid, NULL, &serial, cid);
+    if ((md=EVP_get_digestbyobj(md_oid))==NULL ||
+        (ca_id=OCSP_cert_to_id(md, NULL, ca->cert))==NULL)
+        return 0 ;
+    ours = OCSP_id_issuer_cmp(ca_id, cid)==0 ;
+    OCSP_CERTID_free(ca_id);
+    if (!ours)
+        return 0 ;
+    serial_str(serial, hex);
+    /* Certificates issued since the index was read are added on a miss */
+    if ((e=index_find_serial(hex))==NULL) {
+        index_update();
+        e = index_find_serial(hex);
+    }
+    return e && !strcmp(e->issuer, ca_name) ;
+}
+
+static void ocsp_flush(void)
+{
+    ocsp_cached * c ;
+    ocsp_cached * next ;
+    int i ;
+
+    for (i=0 ; i<OCSP_BUCKETS ; i++) {
+        for (c=ocsp_state.buckets[i] ; c ; c=next) {
+            next = c->next ;
+            ocsp_cached_free(c);
+        }
+        ocsp_state.buckets[i] = NULL ;
+    }
+}
+
+/*
+ * Reload the CRL and drop all cached responses if the CRL changed.
+ * The CRL is only kept as DER: revocation status comes from <ca>.rev,
+ * and the CRL entry is only looked for once a serial is known revoked.
+ */
+static void ocsp_check_crl(char * ca_name)
+{
+    char filename[PATH_SZ];
+    struct stat st ;
+
+    ca_file(ca_name, ".crl", filename);
+    if (stat(filename, &st)!=0)
+        memset(&st, 0, sizeof(st));
+    if (st.st_mtime==ocsp_state.crl_mtime && st.st_ino==ocsp_state.crl_ino &&
+        st.st_size==ocsp_state.crl_size)
+        return ;
+    ocsp_flush();
+    crl_der_free(&ocsp_state.crl);
+    if (st.st_size>0 && crl_der_load(filename, &ocsp_state.crl)==0 &&
+        access(ca_file(ca_name, ".rev", filename), F_OK)!=0) {
+        /* No sidecar yet: build it once from the CRL */
+        rebuild_serial_file(ca_name);
+    }
+    ocsp_state.crl_mtime = st.st_mtime ;
+    ocsp_state.crl_ino   = st.st_ino ;
+    ocsp_state.crl_size  = st.st_size ;
+}
+
+/*
+ * Entry of a revoked serial in the CRL: returns its reason and its date
+ * in *tm, to be freed, or -1 if the CRL does not list it.
+ */
+static int ocsp_crl_entry(unsigned char * serial, ASN1_TIME ** tm)
+{
+    const unsigned char * p = ocsp_state.crl.revoked ;
+    const unsigned char * q ;
+    unsigned char bin[SERIAL_SZ];
+    crl_entry e ;
+
+    *tm = NULL ;
+    while (crl_der_next(&p, ocsp_state.crl.revoked+ocsp_state.crl.revoked_len, &e)==1) {
+        if (der_serial_to_bin(e.serial, e.serial_len, bin)!=0 ||
+            memcmp(bin, serial, SERIAL_SZ))
+            continue ;
+        q = e.date ;
+        *tm = d2i_ASN1_TIME(NULL, &q, e.date_len);
+        return crl_entry_reason(&e);
+    }
+    return -1 ;
+}
+
+/*
+ * Sign a response for all certificates in a request
+ */
+static OCSP_RESPONSE * ocsp_build(OCSP_REQUEST * req, char * ca_name, identity * ca,
+                                  time_t * expires)
+{
+    OCSP_BASICRESP * bs ;
+    OCSP_RESPONSE * resp ;
+    OCSP_CERTID * cid ;
+    OCSP_CERTID * ca_id ;
+    ASN1_OBJECT * md_oid ;
+    ASN1_INTEGER * serial ;
+    unsigned char bin[SERIAL_SZ];
+    const EVP_MD * md ;
+    ASN1_TIME * now ;
+    ASN1_TIME * next ;
+    ASN1_TIME * rev_tm ;
+    int i, status, reason ;
+
+    bs   = OCSP_BASICRESP_new();
+    now  = X509_gmtime_adj(NULL, 0);
+    next = X509_gmtime_adj(NULL, OCSP_VALIDITY);
+    *expires = time(NULL) + OCSP_VALIDITY ;
+
+    for (i=0 ; i<OCSP_request_onereq_count(req) ; i++) {
+        cid = OCSP_onereq_get0_id(OCSP_request_onereq_get0(req, i));
+        OCSP_id_get0_info(NULL, &md_oid, NULL, &serial, cid);
+        md = EVP_get_digestbyobj(md_oid);
+        ca_id = md ? OCSP_cert_to_id(md, NULL, ca->cert) : NULL ;
+        rev_tm = NULL ;
+        reason = 0 ;
+
+        if (!ca_id || OCSP_id_issuer_cmp(ca_id, cid)!=0) {
+            /* Not one of ours */
+            status = V_OCSP_CERTSTATUS_UNKNOWN ;
+        } else if (serial_to_bin(serial, bin)==0 && serial_file_find(ca_name, bin)==1) {
+            status = V_OCSP_CERTSTATUS_REVOKED ;
+            /* Date and reason from the CRL entry, unspecified when absent */
+            if ((reason=ocsp_crl_entry(bin, &rev_tm))<0)
+                reason = OCSP_REVOKED_STATUS_UNSPECIFIED ;
+        } else {
+            status = V_OCSP_CERTSTATUS_GOOD ;
+        }
+        OCSP_basic_add1_status(bs, cid, status, reason,
+                               status==V_OCSP_CERTSTATUS_REVOKED ? (rev_tm ? rev_tm : now) : NULL,
+                               now, next);
+        ASN1_TIME_free(rev_tm);
+        OCSP_CERTID_free(ca_id);
+    }
+    OCSP_basic_sign(bs, ca->cert, ca->key, sign_md(ca->key), NULL, 0);
+    resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs);
+    OCSP_BASICRESP_free(bs);
+    ASN1_TIME_free(now);
+    ASN1_TIME_free(next);
+    return resp ;
+}
 
-    /* Dump CRL */
-    sprintf(filename, "%s.crl", ca_name);
-    if ((f = fopen(filename, "wb"))==NULL) {
-        fprintf(stderr, "Cannot write %s: aborting\n", filename);
-        X509_CRL_free(crl);
-        return ;
+/*
+ * DER response for a request: from the cache when the request is about a
+ * single certificate issued by ca_name, signed on the spot otherwise.
+ * *der is not to be freed if *cached is set.
+ */
+static int ocsp_answer(OCSP_REQUEST * req, char * ca_name, identity * ca,
+                       unsigned char ** der, int * cached)
+{
+    OCSP_RESPONSE * resp ;
+    ocsp_cached * c ;
+    unsigned char * id=NULL ;
+    unsigned int h=0 ;
+    time_t expires ;
+    int id_len=0, len ;
+
+    *cached = 0 ;
+    if (OCSP_request_onereq_count(req)==1) {
+        id_len = i2d_OCSP_CERTID(OCSP_onereq_get0_id(OCSP_request_onereq_get0(req, 0)), &id);
+        h = ocsp_hash(id, id_len);
+        for (c=ocsp_state.buckets[h] ; c ; c=c->next) {
+            if (c->id_len==id_len && !memcmp(c->id, id, id_len) &&
+                c->expires>time(NULL)+60) {
+                OPENSSL_free(id);
+                *der = c->der ;
+                *cached = 1 ;
+                return c->der_len ;
+            }
+        }
     }
-    out = BIO_new(BIO_s_file());
-    BIO_set_fp(out, f, BIO_NOCLOSE);
-    PEM_write_bio_X509_CRL(out, crl);
-    BIO_free_all(out);
-    fclose(f);
-    X509_CRL_free(crl);
-    return ;
+
+    resp = ocsp_build(req, ca_name, ca, &expires);
+    *der = NULL ;
+    len = i2d_OCSP_RESPONSE(resp, der);
+    OCSP_RESPONSE_free(resp);
+    if (id && len>0 &&
+        ocsp_known(OCSP_onereq_get0_id(OCSP_request_onereq_get0(req, 0)), ca_name, ca)) {
+        /* Remember it, replacing an expired copy if any */
+        for (c=ocsp_state.buckets[h] ; c ; c=c->next) {
+            if (c->id_len==id_len && !memcmp(c->id, id, id_len))
+                break ;
+        }
+        if (c) {
+            OPENSSL_free(c->der);
+            OPENSSL_free(id);
+        } else {
+            ocsp_trim(h);
+            c = malloc(sizeof(ocsp_cached));
+            c->id     = id ;
+            c->id_len = id_len ;
+            c->next   = ocsp_state.buckets[h] ;
+            ocsp_state.buckets[h] = c ;
+        }
+        c->der     = *der ;
+        c->der_len = len ;
+        c->expires = expires ;
+        *cached = 1 ;
+    } else {
+        OPENSSL_free(id);
+    }
+    return len ;
 }
 
-int generate_dhparam(int dh_bits)
+/*
+ * Decode %xx escapes in place, for base64 requests sent with GET
+ */
+static void url_decode(char * s)
 {
-    DH * dh ;
-    char filename[FIELD_SZ+1];
-    FILE * out;
+    char * d = s ;
+    int v ;
 
-    sprintf(filename, "dh%d.pem", dh_bits);
-    if ((out=fopen(filename, "wb"))==NULL) {
-        fprintf(stderr, "Cannot create %s: aborting\n", filename);
-        return -1;
+    while (*s) {
+        if (*s=='%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2]) &&
+            sscanf(s+1, "%2x", &v)==1) {
+            *d++ = (char)v ;
+            s += 3 ;
+        } else {
+            *d++ = *s++ ;
+        }
     }
-    dh = DH_new();
-    printf("Generating DH parameters (%d bits) -- this can take long\n", dh_bits);
-    DH_generate_parameters_ex(dh, dh_bits, DH_GENERATOR_2, 0);
-    PEM_write_DHparams(out, dh);
-    fclose(out);
-    printf("done\n");
-    return 0;
+    *d = 0 ;
 }
 
-void usage(void)
+/*
+ * Read one HTTP request, GET or POST, and decode the OCSP request in it
+ */
+static OCSP_REQUEST * ocsp_read_request(int fd)
 {
-    printf(
-        "\n"
-        "\tUse:\n"
-        "\t2cca root   [DN] [days=xx]         # Create a root CA\n"
-        "\t2cca sub    [DN] [days=xx] [ca=xx] # Create a sub CA\n"
-        "\t2cca server [DN] [days=xx] [ca=xx] # Create a server\n"
-        "\t2cca client [DN] [days=xx] [ca=xx] # Create a client\n"
-        "\t2cca www    [DN] [days=xx] [ca=xx] [dns=x] [dns=x]\n"
-        "\n"
-        "Where DN is given as key=val pairs. Supported fields:\n"
-        "\n"
-        "\tO     Organization, only for root (default: Home)\n"
-        "\tCN    Common Name (default: root|server|client\n"
-        "\tC     2-letter country code like US, FR, UK (optional)\n"
-        "\tST    a state name (optional)\n"
-        "\tL     a locality or city name (optional)\n"
-        "\temail an email address\n"
-        "\n"
-        "\tdays specifies certificate duration in days\n"
-        "\n"
-        "Key generation:\n"
-        "\tEither RSA with keysize set by rsa=xx\n"
-        "\tOr elliptic-curve with curve name set by ec=xx\n"
-        "\tDefault is RSA-2048, i.e. rsa=2048\n"
-        "\tSigning CA is specified with ca=CN (default: root)\n"
-        "\n"
-        "CRL management\n"
-        "\t2cca crl [ca=xx]            # Show CRL for CA xx\n"
-        "\t2cca revoke NAME [ca=xx]    # Revoke single cert by name\n"
-        "\n"
-        "\t2cca dh [numbits]           # Generate DH parameters\n"
-        "\n"
-        "Web server certificates\n"
-        "\tGenerate web server certificates using 'wwww'\n"
-        "\tSpecify DNS names using dns=x dns=y on the command-line\n"
-        "\n"
-    );
+    char buf[OCSP_MAX_REQ+1];
+    unsigned char bin[OCSP_MAX_REQ];
+    const unsigned char * p ;
+    char * body ;
+    char * hdr ;
+    char * end ;
+    int got=0, r, len, need ;
+
+    /* Read headers */
+    buf[0] = 0 ;
+    while ((body=strstr(buf, "\r\n\r\n"))==NULL) {
+        if (got>=OCSP_MAX_REQ || (r=read(fd, buf+got, OCSP_MAX_REQ-got))<=0)
+            return NULL ;
+        got += r ;
+        buf[got] = 0 ;
+    }
+    *body = 0 ;
+    body += 4 ;
+
+    if (!strncmp(buf, "POST ", 5)) {
+        need = 0 ;
+        for (hdr=buf ; (hdr=strchr(hdr, '\n'))!=NULL ; ) {
+            hdr++;
+            if (!strncasecmp(hdr, "Content-Length:", 15)) {
+                need = atoi(hdr+15);
+                break ;
+            }
+        }
+        if (need<=0 || need>OCSP_MAX_REQ-(body-buf))
+            return NULL ;
+        while ((buf+got)-body < need) {
+            if ((r=read(fd, buf+got, OCSP_MAX_REQ-got))<=0)
+                return NULL ;
+            got += r ;
+        }
+        p = (unsigned char *)body ;
+        return d2i_OCSP_REQUEST(NULL, &p, need);
+    }
+    if (!strncmp(buf, "GET /", 5)) {
+        /* GET /base64-encoded-request HTTP/1.x */
+        hdr = buf+5 ;
+        if ((end=strchr(hdr, ' '))!=NULL)
+            *end = 0 ;
+        url_decode(hdr);
+        if ((r=strlen(hdr))==0 || r%4)
+            return NULL ;
+        if ((len=EVP_DecodeBlock(bin, (unsigned char *)hdr, r))<=0)
+            return NULL ;
+        p = bin ;
+        return d2i_OCSP_REQUEST(NULL, &p, len);
+    }
+    return NULL ;
 }
 
-int parse_cmd_line(int argc, char ** argv)
+static void ocsp_reply(int fd, unsigned char * der, int len)
 {
-    char key[FIELD_SZ+1] ;
-    char val[FIELD_SZ+1] ;
-    char tmp[FIELD_SZ+1] ;
-    int  ns=0 ;
-    char san[BIG_FIELD+1];
-    int  i ;
+    char hdr[256];
+    int n ;
 
-    memset(san, 0, BIG_FIELD+1);
-    for (i=2 ; i<argc ; i++) { 
-        if (sscanf(argv[i], "%[^=]=%s", key, val)==2) {
-            if (!strcmp(key, "rsa")) {
-                certinfo.rsa_keysz = atoi(val);
-            } else if (!strcmp(key, "ec")) {
-                strcpy(certinfo.ec_name, val);
-            } else if (!strcmp(key, "O")) {
-                strcpy(certinfo.o, val);
-            } else if (!strcmp(key, "C")) {
-                strcpy(certinfo.c, val);
-            } else if (!strcmp(key, "ST")) {
-                strcpy(certinfo.st, val);
-            } else if (!strcmp(key, "CN")) {
-                strcpy(certinfo.cn, val);
-            } else if (!strcmp(key, "L")) {
-                strcpy(certinfo.l, val);
-            } else if (!strcmp(key, "email")) {
-                sprintf(tmp, "email:%s", val);
-                if (ns==0) {
-                    strcpy(san, tmp);
-                } else {
-                    strcat(san, ",\n");
-                    strcat(san, tmp);
-                }
-                ns++;
-            } else if (!strcmp(key, "dns")) {
-                sprintf(tmp, "DNS:%s", val);
-                if (ns==0) {
-                    strcpy(san, tmp);
-                } else {
-                    strcat(san, ",");
-                    strcat(san, tmp);
-                }
-                ns++;
-            } else if (!strcmp(key, "days")) {
-                certinfo.days = atoi(val);
-            } else if (!strcmp(key, "ca")) {
-                strcpy(certinfo.signing_ca, val);
+    n = sprintf(hdr,
+                "HTTP/1.0 200 OK\r\n"
+                "Content-Type: application/ocsp-response\r\n"
+                "Content-Length: %d\r\n"
+                "\r\n", len);
+    if (write(fd, hdr, n)!=n || write(fd, der, len)!=len) {
+        /* Client went away */
+    }
+}
+
+/*
+ * Answer OCSP requests over HTTP for one CA, one connection at a time
+ */
+int run_ocsp(char * ca_name, int port)
+{
+    struct sockaddr_in addr ;
+    struct sigaction   sa ;
+    struct timeval     tv ;
+    OCSP_REQUEST  * req ;
+    OCSP_RESPONSE * resp ;
+    unsigned char * der ;
+    unsigned char * malformed=NULL ;
+    int malformed_len, sock, fd, len, cached, on=1 ;
+    identity ca ;
+
+    if (load_ca(ca_name, &ca)!=0) {
+        fprintf(stderr, "Cannot find CA key/crt\n");
+        return -1 ;
+    }
+    /* Requests name the digest of their certificate IDs by OID */
+    need_algorithms(ALGS_DIGESTS);
+    resp = OCSP_response_create(OCSP_RESPONSE_STATUS_MALFORMEDREQUEST, NULL);
+    malformed_len = i2d_OCSP_RESPONSE(resp, &malformed);
+    OCSP_RESPONSE_free(resp);
+
+    if ((sock=socket(AF_INET, SOCK_STREAM, 0))<0) {
+        perror("socket");
+        return -1 ;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET ;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons(port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))!=0 ||
+        listen(sock, 64)!=0) {
+        perror("bind");
+        close(sock);
+        return -1 ;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_stop ;
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("OCSP responder for %s listening on port %d\n", ca_name, port);
+    fflush(stdout);
+    serving = 1 ;
+    while (serving) {
+        if ((fd=accept(sock, NULL, NULL))<0)
+            continue ;
+        /* Do not let a slow client hold the responder */
+        tv.tv_sec  = 5 ;
+        tv.tv_usec = 0 ;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        if ((req=ocsp_read_request(fd))==NULL) {
+            ocsp_reply(fd, malformed, malformed_len);
+        } else {
+            ocsp_check_crl(ca_name);
+            len = ocsp_answer(req, ca_name, &ca, &der, &cached);
+            if (len>0) {
+                ocsp_reply(fd, der, len);
             } else {
-                fprintf(stderr, "Unsupported field: [%s]\n", key);
-                return -1 ;
+                ocsp_reply(fd, malformed, malformed_len);
             }
+            if (!cached)
+                OPENSSL_free(der);
+            OCSP_REQUEST_free(req);
         }
+        close(fd);
     }
-    if (ns>0) {
-        strcpy(certinfo.san, san);
-        printf("SAN[%s]\n", certinfo.san);
+    close(sock);
+    ocsp_flush();
+    index_free();
+    crl_der_free(&ocsp_state.crl);
+    OPENSSL_free(malformed);
+    X509_free(ca.cert);
+    EVP_PKEY_free(ca.key);
+    printf("OCSP responder stopped\n");
+    return 0 ;
+}
+
+/*
+ * Benchmarks
+ */
+#define BENCH_COUNT     20      /* default number of runs per stage */
+#define BENCH_CRL_RUNS  5       /* runs per CRL size */
+
+/*
+ * Send stdout and stderr to /dev/null while on, to keep chatty stages quiet
+ */
+static void bench_quiet(int on)
+{
+    static int saved_out=-1 ;
+    static int saved_err=-1 ;
+    int fd ;
+
+    fflush(stdout);
+    fflush(stderr);
+    if (on && saved_out<0) {
+        saved_out = dup(1);
+        saved_err = dup(2);
+        if ((fd=open("/dev/null", O_WRONLY))>=0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+            close(fd);
+        }
+    } else if (!on && saved_out>=0) {
+        dup2(saved_out, 1);
+        dup2(saved_err, 2);
+        close(saved_out);
+        close(saved_err);
+        saved_out = saved_err = -1 ;
+    }
+}
+
+static int double_cmp(const void * a, const void * b)
+{
+    double x = *(double *)a ;
+    double y = *(double *)b ;
+    return x<y ? -1 : x>y ;
+}
+
+/*
+ * Print ops/sec, median and 99th percentile for samples in usec
+ */
+static void bench_report(char * stage, double * samples, int n)
+{
+    double total=0 ;
+    int i ;
+
+    if (n<1)
+        return ;
+    for (i=0 ; i<n ; i++) {
+        total += samples[i] ;
+    }
+    qsort(samples, n, sizeof(double), double_cmp);
+    printf("%-28s %6d %12.1f %10.3f %10.3f\n", stage, n,
+           total>0 ? n*1e6/total : 0,
+           samples[n/2]/1e3,
+           samples[(n*99)/100 < n ? (n*99)/100 : n-1]/1e3);
+    fflush(stdout);
+}
+
+static ASN1_INTEGER * bench_serial(void)
+{
+    unsigned char c_serial[SERIAL_SZ] ;
+    ASN1_INTEGER * serial ;
+    BIGNUM * bn ;
+
+    serial_next(c_serial);
+    bn = BN_bin2bn(c_serial, SERIAL_SZ, NULL);
+    serial = BN_to_ASN1_INTEGER(bn, NULL);
+    BN_free(bn);
+    return serial ;
+}
+
+/*
+ * Write a signed CRL for ca with n random revoked serials
+ */
+static int bench_make_crl(char * ca_name, identity * ca, int n)
+{
+    char filename[FIELD_SZ+11];
+    ASN1_INTEGER * serial ;
+    X509_CRL * crl ;
+    ASN1_TIME * tm ;
+    int i, ret ;
+
+    sprintf(filename, "%s-delta.crl", ca_name);
+    unlink(filename);
+    sprintf(filename, "%s.rev", ca_name);
+    unlink(filename);
+
+    crl = X509_CRL_new();
+    X509_CRL_set_version(crl, 1);
+    ASN1_INTEGER_free(crl_next_number(crl));
+    tm = X509_gmtime_adj(NULL, 0);
+    for (i=0 ; i<n ; i++) {
+        serial = bench_serial();
+        X509_CRL_add0_revoked(crl, make_revoked(serial, tm, 0));
+        ASN1_INTEGER_free(serial);
+    }
+    X509_CRL_sort(crl);
+    X509_CRL_set_lastUpdate(crl, tm);
+    X509_gmtime_adj(tm, 365*24*60*60);
+    X509_CRL_set_nextUpdate(crl, tm);
+    ASN1_TIME_free(tm);
+    X509_CRL_set_issuer_name(crl, X509_get_subject_name(ca->cert));
+    X509_CRL_sign(crl, ca->key, sign_md(ca->key));
+    sprintf(filename, "%s.crl", ca_name);
+    ret = write_crl(crl, filename, "write_crl");
+    X509_CRL_free(crl);
+    return ret ;
+}
+
+/*
+ * Remove all files from the benchmark directory, then the directory
+ */
+static void bench_cleanup(char * dir)
+{
+    char path[2*FIELD_SZ+2];
+    struct dirent * de ;
+    DIR * d ;
+
+    if ((d=opendir(dir))==NULL)
+        return ;
+    while ((de=readdir(d))!=NULL) {
+        if (de->d_name[0]=='.')
+            continue ;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+/*
+ * Time each stage of issuance and revocation, in a temporary directory.
+ * Key sizes follow rsa= and ec=, the number of runs follows count=.
+ */
+int run_bench(void)
+{
+    static int crl_sizes[] = {1000, 10000, 100000} ;
+    static struct {
+        char * type ;
+        char * extra ;
+    } profiles[] = {
+        {"sub",    NULL},
+        {"server", NULL},
+        {"client", NULL},
+        {"www",    "DNS:bench.example.com"},
+    } ;
+    char dir[] = "/tmp/2cca-bench-XXXXXX" ;
+    char cwd[4*FIELD_SZ];
+    char stage[2*FIELD_SZ+1];
+    char name[FIELD_SZ+1];
+    char ec_name[FIELD_SZ+1];
+    double * samples ;
+    double t0 ;
+    int i, j, count, rsa_keysz ;
+    EVP_PKEY * pkey ;
+    identity ca, tmp ;
+    X509 * cert ;
+    FILE * f ;
+
+    count     = n_count>0 ? n_count : BENCH_COUNT ;
+    rsa_keysz = certinfo.rsa_keysz ;
+    strcpy(ec_name, certinfo.ec_name[0] ? certinfo.ec_name : "prime256v1");
+
+    if (!getcwd(cwd, sizeof(cwd)) || !mkdtemp(dir) || chdir(dir)!=0) {
+        fprintf(stderr, "Cannot create benchmark directory\n");
+        return -1 ;
+    }
+    /* Scratch files always use the flat layout */
+    store_dir[0] = 0 ;
+    samples = malloc((count>BENCH_CRL_RUNS ? count : BENCH_CRL_RUNS) * sizeof(double));
+    printf("Running benchmarks in %s\n", dir);
+    printf("%-28s %6s %12s %10s %10s\n", "stage", "runs", "ops/sec", "p50 ms", "p99 ms");
+
+    /* Key generation */
+    for (i=0 ; i<count ; i++) {
+        t0 = now_usec();
+        pkey = generate_key(rsa_keysz, NULL, 0);
+        samples[i] = now_usec()-t0 ;
+        EVP_PKEY_free(pkey);
+    }
+    sprintf(stage, "keygen rsa-%d", rsa_keysz);
+    bench_report(stage, samples, count);
+    for (i=0 ; i<count ; i++) {
+        t0 = now_usec();
+        pkey = generate_key(0, ec_name, 0);
+        samples[i] = now_usec()-t0 ;
+        EVP_PKEY_free(pkey);
+    }
+    sprintf(stage, "keygen ec-%s", ec_name);
+    bench_report(stage, samples, count);
+
+    /* Signing CA used for all other stages */
+    certinfo_defaults(&certinfo);
+    set_profile(&certinfo, "root");
+    strcpy(certinfo.cn, "benchca");
+    certinfo.rsa_keysz = rsa_keysz ;
+    bench_quiet(1);
+    i = build_identity(&certinfo, NULL, NULL);
+    bench_quiet(0);
+    if (i!=0) {
+        fprintf(stderr, "Cannot create benchmark CA\n");
+        chdir(cwd);
+        bench_cleanup(dir);
+        free(samples);
+        return -1 ;
+    }
+
+    /* Loading a CA */
+    for (i=0 ; i<count ; i++) {
+        t0 = now_usec();
+        load_ca("benchca", &tmp);
+        samples[i] = now_usec()-t0 ;
+        X509_free(tmp.cert);
+        EVP_PKEY_free(tmp.key);
+    }
+    bench_report("load_ca", samples, count);
+    load_ca("benchca", &ca);
+
+    /* Signature per profile */
+    for (j=0 ; j<(int)(sizeof(profiles)/sizeof(profiles[0])) ; j++) {
+        certinfo_defaults(&certinfo);
+        set_profile(&certinfo, profiles[j].type);
+        strcpy(certinfo.cn, "bench");
+        strcpy(certinfo.ou, "Bench");
+        if (profiles[j].extra)
+            strcpy(certinfo.san, profiles[j].extra);
+        pkey = generate_key(0, ec_name, 0);
+        cert = make_cert(&certinfo, ca.cert, pkey);
+        for (i=0 ; i<count ; i++) {
+            t0 = now_usec();
+            X509_sign(cert, ca.key, sign_md(ca.key));
+            samples[i] = now_usec()-t0 ;
+        }
+        sprintf(stage, "X509_sign %s", profiles[j].type);
+        bench_report(stage, samples, count);
+        if (j<(int)(sizeof(profiles)/sizeof(profiles[0]))-1) {
+            X509_free(cert);
+            EVP_PKEY_free(pkey);
+        }
+    }
+
+    /* Writing key and certificate as PEM */
+    for (i=0 ; i<count ; i++) {
+        t0 = now_usec();
+        if ((f=fopen("bench.key", "wb"))!=NULL) {
+            PEM_write_PrivateKey(f, pkey, NULL, NULL, 0, NULL, NULL);
+            fclose(f);
+        }
+        if ((f=fopen("bench.crt", "wb"))!=NULL) {
+            PEM_write_X509(f, cert);
+            fclose(f);
+        }
+        samples[i] = now_usec()-t0 ;
+    }
+    bench_report("PEM write key+crt", samples, count);
+    X509_free(cert);
+    EVP_PKEY_free(pkey);
+
+    /* Revocation and CRL display for growing CRLs */
+    for (j=0 ; j<(int)(sizeof(crl_sizes)/sizeof(crl_sizes[0])) ; j++) {
+        if (bench_make_crl("benchca", &ca, crl_sizes[j])!=0)
+            break ;
+        bench_quiet(1);
+        for (i=0 ; i<BENCH_CRL_RUNS ; i++) {
+            certinfo_defaults(&certinfo);
+            set_profile(&certinfo, "client");
+            sprintf(certinfo.cn, "revoke-%d-%d", crl_sizes[j], i);
+            strcpy(certinfo.ec_name, ec_name);
+            strcpy(certinfo.signing_ca, "benchca");
+            build_identity(&certinfo, &ca, NULL);
+        }
+        bench_quiet(0);
+        for (i=0 ; i<BENCH_CRL_RUNS ; i++) {
+            sprintf(name, "revoke-%d-%d", crl_sizes[j], i);
+            t0 = now_usec();
+            revoke_cert("benchca", name, 0, &ca);
+            samples[i] = now_usec()-t0 ;
+        }
+        sprintf(stage, "revoke_cert crl=%dk", crl_sizes[j]/1000);
+        bench_report(stage, samples, BENCH_CRL_RUNS);
+        for (i=0 ; i<BENCH_CRL_RUNS ; i++) {
+            bench_quiet(1);
+            t0 = now_usec();
+            show_crl("benchca");
+            samples[i] = now_usec()-t0 ;
+            bench_quiet(0);
+        }
+        sprintf(stage, "show_crl crl=%dk", crl_sizes[j]/1000);
+        bench_report(stage, samples, BENCH_CRL_RUNS);
+    }
+
+    X509_free(ca.cert);
+    EVP_PKEY_free(ca.key);
+    free(samples);
+    if (chdir(cwd)!=0) {
+        fprintf(stderr, "Cannot go back to %s\n", cwd);
     }
+    bench_cleanup(dir);
     return 0 ;
 }
 
 int main(int argc, char * argv[])
 {
-    int dh_bits=2048;
+    int i, n, cn_given ;
+    char pool_path[2*FIELD_SZ+1];
 
 	if (argc<2) {
         usage();
 		return 1 ;
 	}
 
-    OpenSSL_add_all_algorithms();
-
     /* Initialize DN fields to default values */
-    memset(&certinfo, 0, sizeof(certinfo));
-    certinfo.rsa_keysz = RSA_KEYSZ ;
-    strcpy(certinfo.o, "Home");
-    certinfo.days = 3650 ;
-    strcpy(certinfo.signing_ca, "root");
+    certinfo_defaults(&certinfo);
 
-    if ((argc>2) && (parse_cmd_line(argc, argv)!=0)) {
+    /* Shells cannot export 2CCA_STATS, use: env 2CCA_STATS=json 2cca ... */
+    if (getenv("2CCA_STATS") && strcmp(getenv("2CCA_STATS"), "") &&
+        strcmp(getenv("2CCA_STATS"), "0")) {
+        stats_on = 1 ;
+    }
+
+    if ((argc>2) && (parse_cmd_line(&certinfo, argc, argv)!=0)) {
         return -1 ;
     }
 
+    cn_given = certinfo.cn[0]!=0 ;
     if (certinfo.cn[0]==0) {
         strcpy(certinfo.cn, argv[1]);
     }
 
-    if (!strcmp(argv[1], "root")) {
-        certinfo.profile = PROFILE_ROOT_CA ;
-        build_identity();
-    } else if (!strcmp(argv[1], "sub")) {
-        certinfo.profile = PROFILE_SUB_CA ;
-        build_identity();
-    } else if (!strcmp(argv[1], "server")) {
-        certinfo.profile = PROFILE_SERVER ;
-        build_identity() ;
-    } else if (!strcmp(argv[1], "client")) {
-        certinfo.profile = PROFILE_CLIENT ;
-        build_identity() ;
-    } else if (!strcmp(argv[1], "www")) {
-        certinfo.profile = PROFILE_WWW ;
-        build_identity() ;
+    if (set_profile(&certinfo, argv[1])==0) {
+        build_identity(&certinfo, NULL, NULL);
+    } else if (!strcmp(argv[1], "batch")) {
+        if (run_batch((argc>2 && !strchr(argv[2], '=')) ? argv[2] : NULL)!=0) {
+            return 1 ;
+        }
+    } else if (!strcmp(argv[1], "sign")) {
+        if (run_sign()!=0) {
+            return 1 ;
+        }
+    } else if (!strcmp(argv[1], "renew")) {
+        if (run_renew(certinfo.signing_ca)!=0) {
+            return 1 ;
+        }
+    } else if (!strcmp(argv[1], "serve")) {
+        if (run_server(serve_path[0] ? serve_path : SERVE_SOCKET)!=0) {
+            return 1 ;
+        }
+    } else if (!strcmp(argv[1], "ocsp")) {
+        if (run_ocsp(certinfo.signing_ca, ocsp_port>0 ? ocsp_port : OCSP_PORT)!=0) {
+            return 1 ;
+        }
+    } else if (!strcmp(argv[1], "keypool")) {
+        if (argc>2 && !strcmp(argv[2], "fill")) {
+            if (keypool_fill(certinfo.rsa_keysz, certinfo.ec_name,
+                             n_count>0 ? n_count : 1)!=0) {
+                return 1 ;
+            }
+        } else {
+            keypool_path(certinfo.rsa_keysz, certinfo.ec_name, pool_path);
+            printf("%s: %d keys\n", pool_path,
+                   keypool_count(certinfo.rsa_keysz, certinfo.ec_name));
+        }
+    } else if (!strcmp(argv[1], "list")) {
+        list_certs();
+    } else if (!strcmp(argv[1], "find")) {
+        if (find_serial[0]) {
+            n = find_cert(find_serial, NULL);
+        } else if (cn_given || (argc>2 && !strchr(argv[2], '='))) {
+            n = find_cert(NULL, cn_given ? certinfo.cn : argv[2]);
+        } else {
+            fprintf(stderr, "Missing serial=xx or name to look for\n");
+            n = -1 ;
+        }
+        if (n!=0) {
+            return 1 ;
+        }
+    } else if (!strcmp(argv[1], "proof")) {
+        if (find_serial[0]) {
+            n = log_proof(find_serial, NULL);
+        } else if (cn_given || (argc>2 && !strchr(argv[2], '='))) {
+            n = log_proof(NULL, cn_given ? certinfo.cn : argv[2]);
+        } else {
+            n = log_proof(NULL, NULL);
+        }
+        if (n!=0) {
+            return 1 ;
+        }
+    } else if (!strcmp(argv[1], "status")) {
+        if (find_serial[0]) {
+            n = cert_status(certinfo.signing_ca, find_serial, NULL);
+        } else if (cn_given || (argc>2 && !strchr(argv[2], '='))) {
+            n = cert_status(certinfo.signing_ca, NULL, cn_given ? certinfo.cn : argv[2]);
+        } else {
+            fprintf(stderr, "Missing serial=xx or name to check\n");
+            n = -1 ;
+        }
+        return n ;
+    } else if (!strcmp(argv[1], "bench")) {
+        if (run_bench()!=0) {
+            return 1 ;
+        }
     } else if (!strcmp(argv[1], "crl")) {
         show_crl(certinfo.signing_ca);
     } else if (!strcmp(argv[1], "revoke")) {
-        if (argc>2) {
-            revoke_cert(certinfo.signing_ca, argv[2]);
+        /* All words that are not key=val are names to revoke */
+        for (i=2, n=0 ; i<argc ; i++) {
+            if (!strchr(argv[i], '='))
+                argv[2+n++] = argv[i] ;
+        }
+        if (n>0) {
+            if (revoke_certs(certinfo.signing_ca, argv+2, n, certinfo.reason, NULL)!=0) {
+                return 1 ;
+            }
         } else {
             fprintf(stderr, "Missing certificate name for revocation\n");
         }
+    } else if (!strcmp(argv[1], "crl-merge")) {
+        if (merge_crl(certinfo.signing_ca)!=0) {
+            return 1 ;
+        }
+    } else if (!strcmp(argv[1], "crl-base")) {
+        if (rebase_crl(certinfo.signing_ca)!=0) {
+            return 1 ;
+        }
+    } else if (!strcmp(argv[1], "revoke-list")) {
+        if (revoke_list(certinfo.signing_ca,
+                        (argc>2 && !strchr(argv[2], '=')) ? argv[2] : NULL,
+                        certinfo.reason)!=0) {
+            return 1 ;
+        }
     } else if (!strcmp(argv[1], "dh")) {
-        if (argc>2) {
+        if (argc>2 && !strncmp(argv[2], "ffdhe", 5)) {
+            return write_dh_group(argv[2])!=0 ;
+        }
+        if (argc>2 && !strcmp(argv[2], "fill")) {
+            return dhpool_fill(dh_bits, n_count>0 ? n_count : 1)!=0 ;
+        }
+        if (argc>2 && !strchr(argv[2], '=')) {
             dh_bits=atoi(argv[2]);
         }
-        generate_dhparam(dh_bits);
+        if (generate_dhparam(dh_bits, n_jobs)!=0) {
+            return 1 ;
+        }
     }
 	return 0 ;
 }
-